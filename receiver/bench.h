@@ -0,0 +1,42 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * Copyright (c) h.zeller@acm.org. GNU public License.
+ */
+
+#ifndef BENCH_H_
+#define BENCH_H_
+
+#include <avr/io.h>
+
+// Markers for 'make bench'. The image built with -DBENCH=1 writes the marker
+// to GPIOR0 and the simulator (sim/avr-bench) notes the cycle count. Regular
+// builds don't contain any of it.
+// The numbers are shared with the sender and sim/avr-bench.c
+enum BenchMarker {
+  BENCH_ISR           = 1,  // Interrupt handler entry to exit.
+  BENCH_MAIN_LOOP     = 2,  // One pass through the main loop.
+  BENCH_IR_DECODE     = 3,
+  BENCH_POT_UPDATE    = 4,
+  BENCH_EEPROM_FLUSH  = 5,
+  BENCH_WAKE_TO_BURST = 6,  // Wake-up from sleep until the first IR burst.
+  BENCH_BOOT_TO_READY = 7,  // Reset until the pot is at the saved volume.
+};
+
+#if BENCH && !defined(PINA)
+// simavr has no ATtiny48, so the bench image is built for the otherwise
+// register-compatible ATmega48, which lacks port A. Put it where the ATtiny48
+// has it; the simulator treats these unused addresses as plain memory, so the
+// stimulus can poke the button state there.
+#  define PINA  _SFR_IO8(0x0C)
+#  define DDRA  _SFR_IO8(0x0D)
+#  define PORTA _SFR_IO8(0x0E)
+#endif
+
+#if BENCH
+#  define BENCH_BEGIN(marker) GPIOR0 = (marker)
+#  define BENCH_END(marker)   GPIOR0 = (marker) | 0x80
+#else
+#  define BENCH_BEGIN(marker) do {} while (0)
+#  define BENCH_END(marker)   do {} while (0)
+#endif
+
+#endif  // BENCH_H_
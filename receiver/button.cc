@@ -0,0 +1,47 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+#include "button.h"
+
+DebouncedButton::DebouncedButton(uint16_t debounce, uint16_t long_press,
+                                 uint16_t double_press)
+  : debounce_(debounce), long_press_(long_press), double_press_(double_press),
+    raw_(false), stable_(false), long_sent_(false), double_armed_(false),
+    raw_change_(0), stable_change_(0) {
+}
+
+DebouncedButton::Event DebouncedButton::Update(bool input, uint16_t now) {
+  if (input != raw_) {
+    raw_ = input;
+    raw_change_ = now;
+    return NONE;
+  }
+
+  const uint16_t since_change = now - stable_change_;
+  if (raw_ == stable_) {
+    if (stable_ && !long_sent_ && since_change >= long_press_) {
+      long_sent_ = true;
+      return LONG_PRESS;
+    }
+    if (double_armed_ && since_change > double_press_)
+      double_armed_ = false;
+    return NONE;
+  }
+
+  if ((uint16_t)(now - raw_change_) < debounce_)
+    return NONE;   // Still bouncing.
+
+  stable_ = raw_;
+  stable_change_ = now;
+  if (!stable_) {
+    // A long press is not the first half of a double press.
+    double_armed_ = !long_sent_;
+    return RELEASE;
+  }
+  long_sent_ = false;
+  if (double_armed_ && since_change <= double_press_) {
+    double_armed_ = false;
+    long_sent_ = true;   // No long press after a double press.
+    return DOUBLE_PRESS;
+  }
+  double_armed_ = false;
+  return PRESS;
+}
@@ -0,0 +1,52 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#ifndef DEBOUNCED_BUTTON_H_
+#define DEBOUNCED_BUTTON_H_
+
+#include <stdint.h>
+
+// Button with time based debouncing. Emits an event on press and release
+// and detects long and double presses.
+//
+// Times are given in ticks of whatever clock the caller has; the 16 bit
+// timestamps may roll over, so all durations need to be well below that.
+class DebouncedButton {
+public:
+  enum Event {
+    NONE,
+    PRESS,          // Debounced press.
+    RELEASE,        // Debounced release.
+    LONG_PRESS,     // Still pressed after "long_press" ticks. Once per press.
+    DOUBLE_PRESS,   // Pressed again within "double_press" after release;
+                    // emitted instead of PRESS.
+  };
+
+  // Input needs to be stable for "debounce" ticks to be accepted.
+  DebouncedButton(uint16_t debounce, uint16_t long_press,
+                  uint16_t double_press);
+
+  // Feed the raw input at time "now". Returns event, if any.
+  Event Update(bool input, uint16_t now);
+
+  bool is_pressed() const { return stable_; }
+
+  // Change the debounce time, e.g. when tuning it at runtime.
+  void set_debounce(uint16_t debounce) { debounce_ = debounce; }
+
+  // Returns true while there is something still to time out, i.e. the caller
+  // needs to keep calling Update() even if the input doesn't change.
+  bool busy() const { return stable_ || raw_ != stable_ || double_armed_; }
+
+private:
+  uint16_t debounce_;
+  const uint16_t long_press_;
+  const uint16_t double_press_;
+  bool raw_;
+  bool stable_;
+  bool long_sent_;
+  bool double_armed_;
+  uint16_t raw_change_;     // When raw input last changed.
+  uint16_t stable_change_;  // When stable state last changed.
+};
+
+#endif  // DEBOUNCED_BUTTON_H_
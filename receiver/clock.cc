@@ -0,0 +1,69 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * Copyright (c) h.zeller@acm.org. GNU public License.
+ */
+
+#include "clock.h"
+
+#include <avr/interrupt.h>
+#include <avr/io.h>
+
+namespace Clock {
+volatile uint16_t overflow_count;
+volatile uint8_t alarms_fired;
+
+// The compare units only see the low word; an alarm fires at the match
+// when the high word is right as well.
+static uint16_t alarm_high[2];
+static void (*alarm_callback[2])();
+
+static void Fire(uint8_t alarm) {
+  TIMSK1 &= ~(1 << (OCIE1A + alarm));
+  alarms_fired |= 1 << alarm;
+  if (alarm_callback[alarm])
+    alarm_callback[alarm]();
+}
+
+static void Match(uint8_t alarm, uint16_t low) {
+  if (high_word(low) == alarm_high[alarm])
+    Fire(alarm);
+}
+
+void set_alarm(Alarm alarm, long_cycle_t deadline, void (*callback)()) {
+  cli();
+  TIMSK1 &= ~(1 << (OCIE1A + alarm));
+  alarms_fired &= ~(1 << alarm);
+  alarm_high[alarm] = deadline >> 16;
+  alarm_callback[alarm] = callback;
+  if (alarm == ALARM_A)
+    OCR1A = deadline;
+  else
+    OCR1B = deadline;
+  TIFR1 = 1 << (OCF1A + alarm);  // Clear an old match.
+  // The counter might be past it already, or get there before the compare
+  // unit is armed.
+  if ((long_cycle_t) (now32() - deadline) < 0x80000000UL)
+    Fire(alarm);
+  else
+    TIMSK1 |= 1 << (OCIE1A + alarm);
+  sei();
+}
+
+void cancel_alarm(Alarm alarm) {
+  cli();
+  TIMSK1 &= ~(1 << (OCIE1A + alarm));
+  alarms_fired &= ~(1 << alarm);
+  sei();
+}
+}  // namespace Clock
+
+ISR(TIMER1_OVF_vect) {
+  ++Clock::overflow_count;
+}
+
+ISR(TIMER1_COMPA_vect) {
+  Clock::Match(Clock::ALARM_A, OCR1A);
+}
+
+ISR(TIMER1_COMPB_vect) {
+  Clock::Match(Clock::ALARM_B, OCR1B);
+}
@@ -6,6 +6,7 @@
 #define AVR_CLOCK_H_
 
 #include <avr/io.h>
+#include <avr/interrupt.h>
 #include <stdint.h>
 
 /* A 'clock' interface using the 16-Bit counter1.
@@ -16,12 +17,31 @@
  *    if (Clock::now() - last_cyles < Clock::ms_to_cycles(20)) {}
  * The counter rolls over every 8388ms so only time comparisons up to that
  * value make sense.
+ *
+ * For longer times, the overflow interrupt counts the high word of a 32 bit
+ * clock (now32(), rolls over after 6.3 days), and the two compare units of
+ * the timer provide alarms: the main loop checks a flag instead of
+ * comparing times on every pass, or the alarm calls a function from the
+ * interrupt.
  */
 namespace Clock {
 typedef uint16_t cycle_t;
+typedef uint32_t long_cycle_t;
 
+enum Alarm {
+  ALARM_A,   // OCR1A
+  ALARM_B,   // OCR1B
+};
+
+// Defined in clock.cc
+extern volatile uint16_t overflow_count;
+extern volatile uint8_t alarms_fired;
+
+// Starts the timer and enables interrupts.
 static inline void init() {
   TCCR1B = (1<<CS12) | (1<<CS10);  // clk/1024
+  TIMSK1 = (1<<TOIE1);
+  sei();
 }
 
 // The timer with aroud 7.8 kHz rolls over the 64k every 8.3 seconds: so it
@@ -29,12 +49,61 @@ static inline void init() {
 // Returns clock ticks.
 static inline cycle_t now() { return TCNT1; }
 
+// High word at counter value "low". The overflow might have happened but
+// not been counted yet, if interrupts are off or it is pending behind a
+// compare match. Call with interrupts off.
+static inline uint16_t high_word(uint16_t low) {
+  uint16_t high = overflow_count;
+  if ((TIFR1 & (1<<TOV1)) && low < 0x8000)
+    ++high;
+  return high;
+}
+
+// 32 bit clock ticks.
+static inline long_cycle_t now32() {
+  const uint8_t sreg = SREG;
+  cli();
+  const uint16_t low = TCNT1;
+  const uint16_t high = high_word(low);
+  SREG = sreg;
+  return (long_cycle_t) high << 16 | low;
+}
+
+// Called for constant times that don't fit cycle_t; never defined.
+extern void ms_to_cycles_out_of_range()
+  __attribute__((error("longer than 8388ms: use ms_to_long_cycles()")));
+
 // Converts milliseconds into clock cycles. If you provide a constant
 // expression at compile-time, the compiler will be able to replace this
 // with a constant, otherwise it'll get expensive (division and such).
+// Times beyond what cycle_t can hold saturate instead of wrapping around;
+// for constants that is a compile error.
 static inline cycle_t ms_to_cycles(uint16_t ms) {
+  if (__builtin_constant_p(ms) && ms > 0xffffUL * 1000 / (F_CPU / 1024))
+    ms_to_cycles_out_of_range();
+  const uint32_t cycles = ms * (F_CPU / 1024/*prescaler*/) / 1000/*ms*/;
+  return cycles > 0xffff ? 0xffff : cycles;
+}
+static inline long_cycle_t ms_to_long_cycles(uint32_t ms) {
   return ms * (F_CPU / 1024/*prescaler*/) / 1000/*ms*/;
 }
+
+// Arm the alarm for "deadline" (in now32() ticks). When it is reached,
+// "callback" is called from the interrupt, if given, and fired() returns
+// true. A deadline in the past fires right away.
+void set_alarm(Alarm alarm, long_cycle_t deadline, void (*callback)() = 0);
+void cancel_alarm(Alarm alarm);
+
+// Returns true once after the alarm fired.
+static inline bool fired(Alarm alarm) {
+  const uint8_t bit = 1 << alarm;
+  if (!(alarms_fired & bit))
+    return false;
+  cli();
+  alarms_fired &= ~bit;
+  sei();
+  return true;
+}
 };
 
 #endif  // AVR_CLOCK_H_
@@ -0,0 +1,58 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * Copyright (c) h.zeller@acm.org. GNU public License.
+ */
+
+#include "console.h"
+
+#include <stddef.h>
+
+bool LineReader::Poll(SerialCom *com) {
+  if (complete_) {
+    len_ = 0;
+    complete_ = false;
+  }
+  while (com->read_available()) {
+    const char c = com->read();
+    if (c == '\r' || c == '\n') {
+      if (len_ == 0) continue;  // Empty line, or second half of \r\n
+      com->write('\r');
+      com->write('\n');
+      buffer_[len_] = '\0';
+      complete_ = true;
+      return true;
+    }
+    if (len_ < MAX_LINE) {
+      buffer_[len_++] = c;
+      com->write(c);  // Echo.
+    }
+  }
+  return false;
+}
+
+const char *ParseNumber(const char *str, uint16_t *value) {
+  while (*str == ' ')
+    ++str;
+  uint8_t base = 10;
+  if (str[0] == '0' && (str[1] == 'x' || str[1] == 'X')) {
+    base = 16;
+    str += 2;
+  }
+  const char *start = str;
+  uint16_t result = 0;
+  for (;;) {
+    uint8_t digit;
+    const char c = *str | 0x20;  // lower case.
+    if (*str >= '0' && *str <= '9')
+      digit = *str - '0';
+    else if (base == 16 && c >= 'a' && c <= 'f')
+      digit = c - 'a' + 10;
+    else
+      break;
+    result = result * base + digit;
+    ++str;
+  }
+  if (str == start)
+    return NULL;
+  *value = result;
+  return str;
+}
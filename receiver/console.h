@@ -0,0 +1,33 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * Copyright (c) h.zeller@acm.org. GNU public License.
+ */
+
+#ifndef SERIAL_CONSOLE_H_
+#define SERIAL_CONSOLE_H_
+
+#include <stdint.h>
+
+#include "serial-com.h"
+
+// Collects a command line from the serial input without blocking, so that
+// it can be called from the main loop. Once Poll() returns true, line()
+// contains the line without line ending until the next call to Poll().
+class LineReader {
+public:
+  LineReader() : len_(0), complete_(false) {}
+
+  bool Poll(SerialCom *com);
+  const char *line() const { return buffer_; }
+
+private:
+  enum { MAX_LINE = 16 };
+  char buffer_[MAX_LINE + 1];
+  uint8_t len_;
+  bool complete_;
+};
+
+// Parse a decimal or 0x-prefixed hex number, skipping leading blanks.
+// Returns the position after it or NULL if there is no number.
+const char *ParseNumber(const char *str, uint16_t *value);
+
+#endif  // SERIAL_CONSOLE_H_
@@ -2,6 +2,7 @@
 
 #include <avr/io.h>
 #include <util/twi.h>
+#include <util/delay.h>
 
 #include "i2c_master.h"
 
@@ -9,6 +10,34 @@
 #define Prescaler 1
 #define TWBR_val ((((F_CPU / F_SCL) / Prescaler) - 16 ) / 2)
 
+// Waits for the TWI are bounded: a slave stretching SCL forever or a bus
+// without pull-ups would otherwise hang the MCU. A byte takes ~90us at
+// 100kHz; I2C_TIMEOUT polls are about 1ms.
+#define I2C_TIMEOUT 2000
+
+// The TWI pins, driven by hand for bus recovery (ATtiny48/ATmega48).
+#define I2C_PORT PORTC
+#define I2C_DDR  DDRC
+#define I2C_PIN  PINC
+#define I2C_SDA  PC4
+#define I2C_SCL  PC5
+
+uint16_t i2c_timeouts;
+static uint8_t read_failed;
+
+// Wait for the current TWI operation. On timeout, the TWI is reset so that
+// it lets go of the bus; returns 1.
+static uint8_t i2c_wait(void)
+{
+	for (uint16_t i = 0; i < I2C_TIMEOUT; i++)
+	{
+		if (TWCR & (1<<TWINT)) return 0;
+	}
+	TWCR = 0;
+	i2c_timeouts++;
+	return 1;
+}
+
 void i2c_init(void)
 {
 	TWBR = (uint8_t)TWBR_val;
@@ -21,17 +50,19 @@ uint8_t i2c_start(uint8_t address)
 	// transmit START condition
 	TWCR = (1<<TWINT) | (1<<TWSTA) | (1<<TWEN);
 	// wait for end of transmission
-	while( !(TWCR & (1<<TWINT)) );
+	if (i2c_wait()) return 1;
 
-	// check if the start condition was successfully transmitted
-	if((TWSR & 0xF8) != TW_START){ return 1; }
+	// check if the start condition was successfully transmitted. This is also
+	// used for a repeated start, addressing the next device without a stop.
+	uint8_t start_status = TWSR & 0xF8;
+	if((start_status != TW_START) && (start_status != TW_REP_START)){ return 1; }
 
 	// load slave address into data register
 	TWDR = address;
 	// start transmission of address
 	TWCR = (1<<TWINT) | (1<<TWEN);
 	// wait for end of transmission
-	while( !(TWCR & (1<<TWINT)) );
+	if (i2c_wait()) return 1;
 
 	// check if the device has acknowledged the READ / WRITE mode
 	uint8_t twst = TW_STATUS & 0xF8;
@@ -47,7 +78,7 @@ uint8_t i2c_write(uint8_t data)
 	// start transmission of data
 	TWCR = (1<<TWINT) | (1<<TWEN);
 	// wait for end of transmission
-	while( !(TWCR & (1<<TWINT)) );
+	if (i2c_wait()) return 1;
 
 	if( (TWSR & 0xF8) != TW_MT_DATA_ACK ){ return 1; }
 
@@ -60,7 +91,7 @@ uint8_t i2c_read_ack(void)
 	// start TWI module and acknowledge data after reception
 	TWCR = (1<<TWINT) | (1<<TWEN) | (1<<TWEA);
 	// wait for end of transmission
-	while( !(TWCR & (1<<TWINT)) );
+	if (i2c_wait()) read_failed = 1;
 	// return received data from TWDR
 	return TWDR;
 }
@@ -71,7 +102,7 @@ uint8_t i2c_read_nack(void)
 	// start receiving without acknowledging reception
 	TWCR = (1<<TWINT) | (1<<TWEN);
 	// wait for end of transmission
-	while( !(TWCR & (1<<TWINT)) );
+	if (i2c_wait()) read_failed = 1;
 	// return received data from TWDR
 	return TWDR;
 }
@@ -94,6 +125,7 @@ uint8_t i2c_receive(uint8_t address, uint8_t* data, uint16_t length)
 {
 	if (i2c_start(address | I2C_READ)) return 1;
 
+	read_failed = 0;
 	for (uint16_t i = 0; i < (length-1); i++)
 	{
 		data[i] = i2c_read_ack();
@@ -102,7 +134,7 @@ uint8_t i2c_receive(uint8_t address, uint8_t* data, uint16_t length)
 
 	i2c_stop();
 
-	return 0;
+	return read_failed;
 }
 
 uint8_t i2c_writeReg(uint8_t devaddr, uint8_t regaddr, uint8_t* data, uint16_t length)
@@ -129,6 +161,7 @@ uint8_t i2c_readReg(uint8_t devaddr, uint8_t regaddr, uint8_t* data, uint16_t le
 
 	if (i2c_start(devaddr | 0x01)) return 1;
 
+	read_failed = 0;
 	for (uint16_t i = 0; i < (length-1); i++)
 	{
 		data[i] = i2c_read_ack();
@@ -137,11 +170,44 @@ uint8_t i2c_readReg(uint8_t devaddr, uint8_t regaddr, uint8_t* data, uint16_t le
 
 	i2c_stop();
 
-	return 0;
+	return read_failed;
 }
 
 void i2c_stop(void)
 {
 	// transmit STOP condition
 	TWCR = (1<<TWINT) | (1<<TWEN) | (1<<TWSTO);
+	// wait until it is on the bus, so that a following start doesn't
+	// cancel it.
+	for (uint16_t i = 0; TWCR & (1<<TWSTO); i++)
+	{
+		if (i >= I2C_TIMEOUT) { TWCR = 0; i2c_timeouts++; return; }
+	}
+}
+
+// A slave that was interrupted while sending (reset of the master, glitch
+// on SCL) holds SDA low, waiting for the clocks of the rest of its byte.
+// Clock SCL by hand until it lets go, at most 9 pulses, then send a STOP.
+// Returns 0 if the bus is free.
+uint8_t i2c_recover(void)
+{
+	TWCR = 0;  // TWI off; the pins are GPIO.
+	// Open drain: the pins are released (input, external pull-ups) or
+	// driven low.
+	I2C_PORT &= ~((1<<I2C_SDA) | (1<<I2C_SCL));
+	I2C_DDR &= ~((1<<I2C_SDA) | (1<<I2C_SCL));
+	_delay_us(5);
+	for (uint8_t i = 0; i < 9 && !(I2C_PIN & (1<<I2C_SDA)); i++)
+	{
+		I2C_DDR |= (1<<I2C_SCL);
+		_delay_us(5);
+		I2C_DDR &= ~(1<<I2C_SCL);
+		_delay_us(5);
+	}
+	// START then STOP: SDA low and high again while SCL is high.
+	I2C_DDR |= (1<<I2C_SDA);
+	_delay_us(5);
+	I2C_DDR &= ~(1<<I2C_SDA);
+	_delay_us(5);
+	return (I2C_PIN & (1<<I2C_SDA)) ? 0 : 1;
 }
@@ -19,6 +19,10 @@ uint8_t i2c_receive(uint8_t address, uint8_t* data, uint16_t length);
 uint8_t i2c_writeReg(uint8_t devaddr, uint8_t regaddr, uint8_t* data, uint16_t length);
 uint8_t i2c_readReg(uint8_t devaddr, uint8_t regaddr, uint8_t* data, uint16_t length);
 void i2c_stop(void);
+uint8_t i2c_recover(void);
+
+// Number of TWI operations that timed out.
+extern uint16_t i2c_timeouts;
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,173 @@
+/* -*- mode: c++; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * Copyright (c) h.zeller@acm.org. GNU public License.
+ */
+
+#ifndef IR_DECODER_H_
+#define IR_DECODER_H_
+
+#include <stdint.h>
+
+// Loop-count thresholds of the decoder. These are not time but iterations
+// of the counting loop (roughly 9 CPU cycles each at 8Mhz). They can be
+// overridden from the command line to try other bit timings in the host
+// simulation (see sim/).
+// The receiver makes the threshold a runtime tuning parameter with this
+// default.
+#ifndef IR_DEFAULT_LO_HI_BIT_THRESHOLD
+// manual measurment.
+//#  define IR_DEFAULT_LO_HI_BIT_THRESHOLD 0x01CE
+#  define IR_DEFAULT_LO_HI_BIT_THRESHOLD 0x0318
+#endif
+#ifndef IR_LO_HI_BIT_THRESHOLD
+#  define IR_LO_HI_BIT_THRESHOLD IR_DEFAULT_LO_HI_BIT_THRESHOLD
+#endif
+#ifndef IR_END_OF_SIGNAL
+#  define IR_END_OF_SIGNAL (10 * IR_LO_HI_BIT_THRESHOLD)
+#endif
+// A frame starts with a long header burst (~2.2ms from our sender, 9ms with
+// NEC remotes). Anything shorter than IR_MIN_HEADER is a glitch or the tail
+// of a burst we came in late for, longer than IR_HEADER_TIMEOUT a stuck line.
+#ifndef IR_MIN_HEADER
+#  define IR_MIN_HEADER IR_LO_HI_BIT_THRESHOLD
+#endif
+#ifndef IR_HEADER_TIMEOUT
+#  define IR_HEADER_TIMEOUT (12 * IR_LO_HI_BIT_THRESHOLD)
+#endif
+// The bursts between bits are short; a line that stays low much longer is
+// stuck, not a signal.
+#ifndef IR_LOW_TIMEOUT
+#  define IR_LOW_TIMEOUT (4 * IR_LO_HI_BIT_THRESHOLD)
+#endif
+// The whole frame, header included, may not take longer than this (~72ms at
+// the default bit threshold): our longest frame, all ones, takes 65ms, an
+// NEC frame 67.5ms. Anything longer is not a frame, and we don't want to
+// keep the main loop waiting for it.
+#ifndef IR_FRAME_TIMEOUT
+#  define IR_FRAME_TIMEOUT 64000
+#endif
+// Ambient light glitches are short low pulses: within a high phase, low
+// pulses shorter than IR_MIN_PULSE (~110us) don't end it. Within a burst,
+// the line only goes high briefly if the burst is the end of it: the pause
+// of a zero bit can come out of the TSOP a lot shorter than sent when the
+// edges jitter, so IR_MIN_PAUSE (~45us) is enough there.
+#ifndef IR_MIN_PULSE
+#  define IR_MIN_PULSE 100
+#endif
+#ifndef IR_MIN_PAUSE
+#  define IR_MIN_PAUSE 40
+#endif
+
+// Returned by decode_infrared() if accept_first_byte() didn't like the first
+// byte. The rest of the frame is still on air.
+#define IR_FOREIGN_FRAME 0x80
+
+static inline bool ir_accept_any(uint8_t) { return true; }
+
+// Count how long the input stays at "level", starting with "count" and
+// stopping at "limit". Excursions to the other level shorter than
+// IR_MIN_PULSE (low) or IR_MIN_PAUSE (high) are counted as part of the
+// phase. The tight inner loop is the same as before, so the loop-count
+// thresholds still apply.
+template <bool (*infrared_in)(), bool level>
+static inline unsigned short ir_count_phase(unsigned short count,
+                                            unsigned short limit) {
+    for (;;) {
+        for (/**/; infrared_in() == level && count < limit; ++count)
+            ;
+        if (count >= limit)
+            return count;
+        const uint8_t min_other = level ? IR_MIN_PULSE : IR_MIN_PAUSE;
+        uint8_t other = 0;
+        while (infrared_in() != level) {
+            if (++other >= min_other)
+                return count;  // Real level change.
+        }
+        count += other;  // Just a glitch.
+    }
+}
+
+// Decode up to four bytes from the infrared input. The template parameter
+// is the function reading the (active low) pin, so that the same code runs
+// on the AVR and against a simulated pin on the host.
+// If "histogram" is given, the raw high-phase counts are recorded in
+// it, shifted right by HISTOGRAM_SHIFT (to be defined before including this
+// header).
+// The first byte of our frames is the device ID: if accept_first_byte()
+// returns false for it, we stop right there and return IR_FOREIGN_FRAME.
+//
+// Returns number of complete bytes read. If the line is still low when this
+// returns, it is stuck.
+// (lifted from my other project, rc-screen)
+//
+// Every phase is bounded by a loop count and all of them together by
+// IR_FRAME_TIMEOUT, so the time spent here is bounded regardless of the
+// input: at most IR_FRAME_TIMEOUT + IR_MIN_PULSE loop iterations (verified
+// by sim/ir-fuzz).
+template <bool (*infrared_in)(), bool (*accept_first_byte)(uint8_t) = ir_accept_any>
+static inline uint8_t decode_infrared(uint8_t *buffer, uint8_t *histogram) {
+    // The infrared input is default high.
+    // A transmission starts with a long low phase (which triggered us to
+    // be in this routine in the first place), followed by a sequence of bits
+    // that are encoded in the duration of the high-phases. We interpret that as
+    // long == 1, short == 0. The end of the signal is reached once we see the
+    // high phase to be overly long (or: when 4 bytes are read).
+    // The timings were determined empirically.
+    uint8_t read = 0;
+    uint8_t current_bit = 0x80;
+    *buffer = 0;
+
+    const unsigned short lo_hi_bit_threshold = IR_LO_HI_BIT_THRESHOLD;
+    const unsigned short end_of_signal = IR_END_OF_SIGNAL;
+    const unsigned short low_timeout = IR_LOW_TIMEOUT;
+    unsigned short count;
+    unsigned short limit;
+    unsigned short remaining;   // Of IR_FRAME_TIMEOUT.
+
+    count = ir_count_phase<infrared_in, false>(0, IR_HEADER_TIMEOUT);
+    if (count < IR_MIN_HEADER || count >= IR_HEADER_TIMEOUT)
+        return 0;
+    remaining = IR_FRAME_TIMEOUT - count;
+
+    while (read < 4) {
+        // The high phase encodes the bit. Detecting its start took
+        // IR_MIN_PAUSE samples already.
+        limit = end_of_signal < remaining ? end_of_signal : remaining;
+        count = ir_count_phase<infrared_in, true>(IR_MIN_PAUSE, limit);
+        if (count >= limit)
+            break; // we're done - final high state, or out of time.
+        remaining -= count;
+        if (count > lo_hi_bit_threshold) {
+            *buffer |= current_bit;
+        }
+
+#ifdef HISTOGRAM_SHIFT
+        if (histogram) {
+            count >>= HISTOGRAM_SHIFT;
+            if (count > 254) count = 254;
+            histogram[count]++;
+        }
+#endif
+
+        current_bit >>= 1;
+        if (!current_bit) {
+            current_bit = 0x80;
+            ++read;
+            if (read == 1 && !accept_first_byte(*buffer))
+                return IR_FOREIGN_FRAME;
+            if (read == 4)
+                break;
+            ++buffer;
+            *buffer = 0;
+        }
+
+        // skip low phase, wait for high.
+        limit = low_timeout < remaining ? low_timeout : remaining;
+        count = ir_count_phase<infrared_in, false>(IR_MIN_PULSE, limit);
+        if (count >= limit)
+            return read;  // stuck low, or out of time.
+        remaining -= count;
+    }
+    return read;
+}
+
+#endif  // IR_DECODER_H_
@@ -15,13 +15,28 @@
 #include <avr/interrupt.h>
 #include <util/delay.h>
 #include <avr/eeprom.h>
+#include <avr/pgmspace.h>
 
+#include "bench.h"
+#include "button.h"
 #include "quad.h"
 #include "clock.h"
 #include "i2c_master.h"
+#include "tuning.h"
+
+// If histogram shift is defined, we spit out a histogram. And it only makes
+// sense if we do serial. Needs to be known before ir-decoder.h is included.
+#if DO_SERIAL_COM
+#  define HISTOGRAM_SHIFT 3
+#endif
+
+// The decoder threshold can be tuned at runtime.
+#define IR_LO_HI_BIT_THRESHOLD tuning.ir_bit_threshold
+#include "ir-decoder.h"
 
 #if DO_SERIAL_COM
 #  include "serial-com.h"
+#  include "console.h"
 #else
 typedef int SerialCom;  // dummy type.
 // TODO: a version that sends via SPI
@@ -40,14 +55,124 @@ typedef int SerialCom;  // dummy type.
 #define BUTTON_PORT_OUT PORTA
 #define BUTTON_IN       (1<<2)
 
-#define DIGIPOT_READ  0x51
+// Button timings. The debounce time is a tuning parameter with this default.
+#define BUTTON_DEBOUNCE_MS      30
+#define BUTTON_LONG_PRESS_MS   800
+#define BUTTON_DOUBLE_PRESS_MS 400
+
+// Balance: the louder channel stays, the other one is attenuated by up to
+// BALANCE_MAX wiper steps (~1dB each). Adjusted by turning the knob while
+// the button is held, or with the 'b' IR command (signed steps in the
+// argument); our remote doesn't send that, it is for other senders. The LED ring shows it for BALANCE_DISPLAY_MS, centered at LED 14.
+#define BALANCE_MAX            14
+#define BALANCE_DISPLAY_MS   1500
+
+// IR front end. If more than IR_CHATTER_LIMIT decode attempts fail within
+// IR_CHATTER_WINDOW_MS, or the line is stuck low, ignore IR for IR_BACKOFF_MS.
+// A frame we came in late for yields one failed attempt per remaining bit,
+// so the limit needs to be well above 32.
+#define IR_CHATTER_LIMIT        48
+#define IR_CHATTER_WINDOW_MS   250
+#define IR_BACKOFF_MS         1000
+
+// Frames start with the device ID of the remote. Frames from other remotes are
+// rejected after that first byte and IR is ignored for IR_FOREIGN_SKIP_MS, a
+// bit less than the shortest possible rest of the frame.
+// Holding the button at power-up enters pairing mode: the next double press
+// on a remote within PAIRING_TIMEOUT_MS pairs it. The paired remote keeps
+// working meanwhile.
+#define IR_FOREIGN_SKIP_MS      20
+#define PAIRING_TIMEOUT_MS    5000
+
+// The last byte of a frame is a sequence number (high nibble) and a check
+// nibble, which makes the XOR of all nibbles of the frame zero; frames that
+// fail it have bit errors and are dropped. Remotes send each frame more
+// than once; a frame with the same device ID and last byte as the previous
+// one within IR_DEDUP_MS is such a copy and ignored, so that a toggle
+// doesn't toggle back.
+#define IR_DEDUP_MS            500
+
+// Learn mode, entered and left with a long press (on release, and only if
+// the knob wasn't turned meanwhile: that is balance): the receiver binds
+// codes of any remote to actions, one after the other (up, down, mute, fine
+// up, fine down, preset). A short press skips an action. Up and down go
+// LEARN_COARSE_STEP knob positions, fine up and down one; the preset is the
+// volume at the time it is learned. Up to LEARN_SLOTS codes are kept. The
+// new codes replace the old ones only when learn mode is left with a long
+// press; on timeout (LEARN_TIMEOUT_MS without progress) they are dropped,
+// so a stray long press can't wipe the table.
+// Learned remotes don't number their frames, so only copies within
+// IR_LEARNED_DEDUP_MS, less than a NEC frame period, are dropped.
+#define LEARN_SLOTS              5
+#define LEARN_COARSE_STEP        3
+#define LEARN_TIMEOUT_MS     10000  // Beyond Clock::now(): a 32 bit alarm.
+#define IR_LEARNED_DEDUP_MS     80
+
+// Defaults of other tuning parameters: the volume is written to EEPROM once
+// it has not changed for EEPROM_WRITE_DELAY_MS. The mute blink period is
+// MUTE_BLINK_MASK + 1 clock ticks.
+#define EEPROM_WRITE_DELAY_MS 1000
+#define MUTE_BLINK_MASK     0x1FFF
+
+// Boot: the pot starts at full attenuation and ramps up to the saved value
+// one step every BOOT_RAMP_STEP_MS, so the amp doesn't come up with a bang.
+// Encoder changes are ignored until it has been quiet for ENCODER_SETTLE_MS.
+#define BOOT_RAMP_STEP_MS       10
+#define ENCODER_SETTLE_MS      100
+
+// Volume presets, set from the remote: a frame 's' stores the current
+// volume in the slot given in the argument, 'g' ramps to it, one knob
+// position every PRESET_RAMP_STEP_MS.
+#define PRESET_SLOTS             4
+#define PRESET_RAMP_STEP_MS     15
+
 #define DIGIPOT_WRITE 0x50
+#define DS1882_CONFIG 0x86  // 63 step mode.
 
-// If histogram shift is defined, we spit out a histogram. And it only makes
-// sense if we do serial.
-#if DO_SERIAL_COM
-#  define HISTOGRAM_SHIFT 3
+// Pot writes are read back (write address of each pot | I2C_READ) and
+// compared, unless DIGIPOT_VERIFY is 0. A write that fails (no ACK, bus
+// timeout, different read-back) is retried from the main loop after
+// recovering the bus, up to I2C_RETRIES times, with the wait doubling from
+// I2C_RETRY_MS.
+#ifndef DIGIPOT_VERIFY
+#  define DIGIPOT_VERIFY 1
 #endif
+#define I2C_RETRIES              5
+#define I2C_RETRY_MS             2
+
+// The DS1882s on the bus: write address (0x50 | A2..A0 << 1) and an offset
+// in wiper steps (~1dB, positive is more attenuation) to level-match the
+// channels. All are set from the same knob, e.g. for a multichannel preamp:
+//   -D'DIGIPOTS={ { 0x50, 0 }, { 0x52, 0 }, { 0x54, 3 } }'
+#ifndef DIGIPOTS
+#  define DIGIPOTS { { DIGIPOT_WRITE, 0 } }
+#endif
+
+// Latency markers for the scope: with LATENCY_MARKERS, LATENCY_BIT goes high
+// when an IR frame starts, low when it is decoded, and pulses when the
+// resulting pot write is done. The sender pulses its IR_DEBUG_BIT when it
+// sees a detent and at the end of the frame; with both on a two-channel
+// scope, every stage from knob to pot can be measured.
+#ifndef LATENCY_MARKERS
+#  define LATENCY_MARKERS 0
+#endif
+#define LATENCY_PORT PORTC
+#define LATENCY_DDR  DDRC
+#define LATENCY_BIT  (1<<0)
+#if LATENCY_MARKERS
+#  define LATENCY_HIGH() LATENCY_PORT |= LATENCY_BIT
+#  define LATENCY_LOW()  LATENCY_PORT &= ~LATENCY_BIT
+#else
+#  define LATENCY_HIGH() do {} while (0)
+#  define LATENCY_LOW()  do {} while (0)
+#endif
+
+// With the serial console, we also keep a histogram of the latency in clock
+// ticks (128us) of the same stages: frame start to decoded, decoded to pot
+// written. Bucket n counts 2^(n-1) .. 2^n - 1 ticks, the last one everything
+// longer.
+#define LATENCY_BUCKETS 10
+enum LatencyStage { LATENCY_DECODE, LATENCY_POT, LATENCY_STAGES };
 
 static inline uint8_t quad_in() {
     // Flipping one bit as we get the signal in the wrong sequence.
@@ -56,17 +181,218 @@ static inline uint8_t quad_in() {
 static inline bool infrared_in() { return (IR_PORT_IN & IR_IN) != 0; }
 static inline bool button_in() { return (BUTTON_PORT_IN & BUTTON_IN) == 0; }
 
+// The check nibble of our frames; see IR_DEDUP_MS.
+static inline bool frame_check_ok(const uint8_t *frame) {
+    const uint8_t x = frame[0] ^ frame[1] ^ frame[2] ^ frame[3];
+    return ((x ^ (x >> 4)) & 0x0f) == 0;
+}
+
+// A frame of one of our remotes, paired or not: these are never learned.
+static bool is_own_frame(const uint8_t *frame) {
+    if (!frame_check_ok(frame))
+        return false;
+    switch (frame[1]) {
+    case 'm': case 'l': case 'p': case 'r': case 'h': case 'd':
+    case 'b': case 's': case 'g':
+        return true;
+    default:
+        return false;
+    }
+}
+
+// A learned code: the first byte of the frame and the other three folded
+// into one. Whatever the decoder makes of the timing of a foreign remote,
+// it is the same every time for the same button. NEC style remotes send
+// [address][~address or address][command][~command], but the decoder takes
+// the space after their header for a bit, so everything is one bit late:
+// the last byte is command bit 7 and ~command bits 0-6. A plain XOR would
+// cancel the command against its complement; with the last byte rotated
+// by one, all 256 commands of a remote get different codes. Our own
+// remotes number their frames, so they aren't learned.
+// The action is in the upper 3 bits, its argument (preset) in the lower 5.
+struct LearnedCode {
+    uint8_t device;
+    uint8_t code;
+    uint8_t action;
+};
+enum LearnAction {
+    LEARN_NONE, LEARN_UP, LEARN_DOWN, LEARN_MUTE, LEARN_FINE_UP,
+    LEARN_FINE_DOWN, LEARN_PRESET, LEARN_ACTION_COUNT
+};
+#define LEARN_ACTION(action, arg) ((action) << 5 | (arg))
+
 struct EepromLayout {
     // The first character sometimes seems to be wiped out in power-glitch
     // situations; so let's not store anything of interest here.
     uint8_t dummy;
 
     uint8_t value;
+    uint8_t presets[PRESET_SLOTS];  // Knob positions. 0xff: not set.
     uint8_t is_muted;
+    uint8_t balance;         // Offset by BALANCE_CENTER.
+
+    // Channel tracking correction: wiper steps added to the right channel,
+    // per position. Signed nibbles, low nibble first. Only used if
+    // tracking_magic is TRACKING_MAGIC.
+    uint8_t tracking_magic;
+    uint8_t tracking[15];
+
+    uint8_t paired_device;   // Remote we listen to. 0xff: any.
+
+    struct TuningBlock tuning;
+
+    struct LearnedCode learned[LEARN_SLOTS];  // Unused: LEARN_NONE
 };
+#define BALANCE_CENTER 0x80
+#define TRACKING_MAGIC 0x7c
+
+// Correction for the tracking table to be flashed with 'make eeprom-flash'
+// after measuring the pot, e.g. -D'TRACKING_TABLE={ 0x00, 0x1f, ... }'
+#ifndef TRACKING_TABLE
+#  define TRACKING_TABLE { 0 }
+#endif
 
 // EEPROM layout with some defaults in case we'd want to prepare eeprom flash.
-struct EepromLayout EEMEM ee_data = { 0, 0, 0 };
+struct EepromLayout EEMEM ee_data = { 0, 0, { 0xff, 0xff, 0xff, 0xff },
+                                      0, BALANCE_CENTER,
+                                      TRACKING_MAGIC, TRACKING_TABLE, 0xff,
+                                      { 0xff /* not tuned */, 0, 0, 0, 0, 0, { 0 } },
+                                      { { 0, 0, LEARN_NONE } } };
+
+// In flash; SRAM is tight.
+static const Tuning kDefaultTuning PROGMEM = {
+    IR_DEFAULT_LO_HI_BIT_THRESHOLD,
+    BUTTON_DEBOUNCE_MS,
+    EEPROM_WRITE_DELAY_MS,
+    MUTE_BLINK_MASK,
+    {
+        0,  1, 2, 3, 4, 5,   // 1 step.
+        7,  9, 11, 13, 15, 17, 19, 21, 23, 25, 27, 31, 33, 35, 37, 39,  // 2 step.
+        42, 45, 48, 51, 54, 57, 60, 63  // 3 step.
+    }
+};
+Tuning tuning;
+
+static void LoadDefaultTuning() {
+    memcpy_P(&tuning, &kDefaultTuning, sizeof(tuning));
+}
+
+// Device ID of the remote we're paired with, 0xff if none. While pairing,
+// we listen to all of them.
+static uint8_t paired_device = 0xff;
+static bool pairing_mode = false;
+
+// The learned codes, sorted by device and code, so that matching is a
+// binary search.
+class LearnedCodes {
+public:
+    LearnedCodes() : count_(0) {}
+
+    void Load() {
+        count_ = 0;
+        for (uint8_t i = 0; i < LEARN_SLOTS; ++i) {
+            LearnedCode c;
+            eeprom_read_block(&c, &ee_data.learned[i], sizeof(c));
+            const uint8_t action = c.action >> 5;
+            if (action != LEARN_NONE && action < LEARN_ACTION_COUNT)
+                Insert(c.device, c.code, c.action);
+        }
+    }
+
+    // Returns the action bound to the frame, LEARN_NONE if none.
+    uint8_t Find(const uint8_t *frame) const {
+        const uint8_t code = Code(frame);
+        const uint8_t i = LowerBound(frame[0], code);
+        if (i < count_ && codes_[i].device == frame[0]
+            && codes_[i].code == code)
+            return codes_[i].action;
+        return LEARN_NONE;
+    }
+
+    // Do we know codes with this first byte?
+    bool HasDevice(uint8_t device) const {
+        const uint8_t i = LowerBound(device, 0);
+        return i < count_ && codes_[i].device == device;
+    }
+
+    // Forget all codes. The EEPROM keeps them until Save().
+    void Clear() { count_ = 0; }
+
+    // Bind the code of the frame to the action, replacing an earlier
+    // binding of the same code. Returns false if the table is full.
+    // Like Clear(), only in RAM; Load() goes back to the saved codes.
+    bool Add(const uint8_t *frame, uint8_t action) {
+        return Insert(frame[0], Code(frame), action);
+    }
+
+    void Save() {
+        static const LearnedCode kUnused = { 0, 0, LEARN_NONE };
+        for (uint8_t i = 0; i < LEARN_SLOTS; ++i) {
+            eeprom_update_block(i < count_ ? &codes_[i] : &kUnused,
+                                &ee_data.learned[i], sizeof(LearnedCode));
+        }
+    }
+
+private:
+    static uint8_t Code(const uint8_t *frame) {
+        return frame[1] ^ frame[2] ^ (frame[3] << 1 | frame[3] >> 7);
+    }
+
+    // Index of the first entry not less than device/code.
+    uint8_t LowerBound(uint8_t device, uint8_t code) const {
+        const uint16_t key = device << 8 | code;
+        uint8_t lo = 0, hi = count_;
+        while (lo < hi) {
+            const uint8_t mid = (lo + hi) / 2;
+            if ((codes_[mid].device << 8 | codes_[mid].code) < key)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        return lo;
+    }
+
+    bool Insert(uint8_t device, uint8_t code, uint8_t action) {
+        uint8_t i = LowerBound(device, code);
+        if (i < count_ && codes_[i].device == device
+            && codes_[i].code == code) {
+            codes_[i].action = action;
+            return true;
+        }
+        if (count_ == LEARN_SLOTS)
+            return false;
+        for (uint8_t j = count_; j > i; --j)
+            codes_[j] = codes_[j-1];
+        codes_[i].device = device;
+        codes_[i].code = code;
+        codes_[i].action = action;
+        ++count_;
+        return true;
+    }
+
+    LearnedCode codes_[LEARN_SLOTS];
+    uint8_t count_;
+};
+static LearnedCodes learned_codes;
+static bool learn_mode = false;
+
+static bool accept_device(uint8_t id) {
+    return pairing_mode || learn_mode || paired_device == 0xff
+        || id == paired_device || learned_codes.HasDevice(id);
+}
+
+#if DO_SERIAL_COM
+static uint8_t latency[LATENCY_STAGES][LATENCY_BUCKETS];
+static void RecordLatency(uint8_t stage, Clock::cycle_t ticks) {
+    uint8_t bucket = 0;
+    for (/**/; ticks && bucket < LATENCY_BUCKETS - 1; ticks >>= 1)
+        ++bucket;
+    if (latency[stage][bucket] < 0xff)
+        ++latency[stage][bucket];
+}
+#else
+static inline void RecordLatency(uint8_t stage, Clock::cycle_t ticks) {}
+#endif
 
 #if DO_SERIAL_COM
 static uint8_t histogram[255];
@@ -82,57 +408,18 @@ static void PrintString(SerialCom *out, const char *str) {
 }
 #endif
 
-// (lifted from my other project, rc-screen)
 static uint8_t read_infrared(uint8_t *buffer, SerialCom *com) {
-    // The infrared input is default high.
-    // A transmission starts with a long low phase (which triggered us to
-    // be in this routine in the first place), followed by a sequence of bits
-    // that are encoded in the duration of the high-phases. We interpret that as
-    // long == 1, short == 0. The end of the signal is reached once we see the
-    // high phase to be overly long (or: when 4 bytes are read).
-    // The timings were determined empirically.
-    uint8_t read = 0;
-    uint8_t current_bit = 0x80;
-    *buffer = 0;
-
-    // manual measurment.
-    //const unsigned short lo_hi_bit_threshold = 0x01CE;
-    const unsigned short lo_hi_bit_threshold = 0x0318;
-    const unsigned short end_of_signal = 10 * lo_hi_bit_threshold;
-    unsigned short count = 0;
-
-#ifdef HISTOGRAM_SHIFT
+    BENCH_BEGIN(BENCH_IR_DECODE);
+#ifndef HISTOGRAM_SHIFT
+    const uint8_t read = decode_infrared<infrared_in, accept_device>(buffer, 0);
+    BENCH_END(BENCH_IR_DECODE);
+    return read;
+#else
+    const uint8_t read = decode_infrared<infrared_in, accept_device>(buffer,
+                                                                    histogram);
+    BENCH_END(BENCH_IR_DECODE);
     const uint8_t* print_buffer = buffer;
-    uint8_t divider = lo_hi_bit_threshold >> HISTOGRAM_SHIFT;
-#endif
-
-    while (read < 4) {
-        while (!infrared_in()) {}  // skip low phase, wait for high.
-        for (count = 0; infrared_in() && count < end_of_signal; ++count)
-            ;
-        if (count >= end_of_signal)
-            break; // we're done - final high state.
-        if (count > lo_hi_bit_threshold) {
-            *buffer |= current_bit;
-        }
-
-#ifdef HISTOGRAM_SHIFT
-        count >>= HISTOGRAM_SHIFT;
-        if (count > 255) count = 255;
-        histogram[count]++;
-#endif
-
-        current_bit >>= 1;
-        if (!current_bit) {
-            current_bit = 0x80;
-            ++read;
-            if (read == 4)
-                break;
-            ++buffer;
-            *buffer = 0;
-        }
-    }
-#ifdef HISTOGRAM_SHIFT
+    uint8_t divider = IR_LO_HI_BIT_THRESHOLD >> HISTOGRAM_SHIFT;
     PrintString(com, "hist: [");
     for (int i = 0; i < 255; ++i) {
         if (i == divider) {
@@ -151,34 +438,66 @@ static uint8_t read_infrared(uint8_t *buffer, SerialCom *com) {
     printHexByte(com, print_buffer[2]);
     printHexByte(com, print_buffer[3]);
     PrintString(com, "\r\n");
-#endif
     return read;
+#endif
 }
 
-class DebouncedButton {
+// Watches the outcome of IR decode attempts. A TSOP output that is stuck low
+// or chatters (sunlight, CFL lamps, disconnected flex cable) makes us enter
+// the decoder all the time for nothing. In that case, stop looking at IR for
+// a while so that the local knob stays responsive.
+class InfraredGuard {
 public:
-    DebouncedButton() : is_on_(false), debounce_count_(0) {}
+    InfraredGuard() : paused_(false), failed_count_(0), window_start_(0),
+                      pause_start_(0), pause_length_(0), backoff_count_(0) {}
 
-    bool DetectEdge(bool input) {
-        if (!input) {
-            is_on_ = false;
-            debounce_count_ = 0;
-            return false;
-        }
-        else if (is_on_) {
+    // Returns if IR decoding is enabled right now.
+    bool enabled(Clock::cycle_t now) {
+        if (paused_ && now - pause_start_ > pause_length_)
+            paused_ = false;
+        return !paused_;
+    }
+
+    // A frame for another receiver: skip the rest of it. Its bursts still
+    // on air after that don't count as chatter.
+    void ForeignFrame(Clock::cycle_t now) {
+        Pause(now, Clock::ms_to_cycles(IR_FOREIGN_SKIP_MS));
+        failed_count_ = 0;
+    }
+
+    // Report the outcome of a decode attempt and if the line is still low
+    // after it. Returns true if this starts a backoff.
+    bool Report(bool got_frame, bool line_low, Clock::cycle_t now) {
+        if (got_frame)
             return false;
+        if (now - window_start_ > Clock::ms_to_cycles(IR_CHATTER_WINDOW_MS)) {
+            window_start_ = now;
+            failed_count_ = 0;
         }
-        else if (++debounce_count_ < 100) {
+        if (!line_low && ++failed_count_ < IR_CHATTER_LIMIT)
             return false;
-        }
-        is_on_ = true;
-        debounce_count_ = 0;
+        Pause(now, Clock::ms_to_cycles(IR_BACKOFF_MS));
+        failed_count_ = 0;
+        ++backoff_count_;
         return true;
     }
 
+    // Number of times we had to back off.
+    uint16_t backoff_count() const { return backoff_count_; }
+
 private:
-    bool is_on_;
-    uint16_t debounce_count_;
+    void Pause(Clock::cycle_t now, Clock::cycle_t length) {
+        paused_ = true;
+        pause_start_ = now;
+        pause_length_ = length;
+    }
+
+    bool paused_;
+    uint8_t failed_count_;
+    Clock::cycle_t window_start_;
+    Clock::cycle_t pause_start_;
+    Clock::cycle_t pause_length_;
+    uint16_t backoff_count_;
 };
 
 struct CharlieLookup {
@@ -212,53 +531,397 @@ void led_output(uint8_t value, bool on) {
     PORTD = ((on ? 1 : 0) << data.row);
 }
 
+struct Digipot {
+    uint8_t address;
+    int8_t offset;
+};
+static const Digipot digipots[] = DIGIPOTS;
+#define DIGIPOT_COUNT (sizeof(digipots) / sizeof(digipots[0]))
+
+static uint8_t clamp_wiper(int16_t wiper) {
+    if (wiper < 0) return 0;
+    if (wiper > 63) return 63;
+    return wiper;
+}
+
+// Write both wipers of all pots in one transaction with repeated STARTs;
+// with "config", the configuration register is set first. The pot offsets
+// are added unless "exact".
+// Returns false if a pot didn't acknowledge or, with DIGIPOT_VERIFY, doesn't
+// read back what was written.
+static bool ds1882_write(uint8_t left, uint8_t right, bool exact,
+                         bool config) {
+    bool ok = true;
+    for (uint8_t i = 0; i < DIGIPOT_COUNT; ++i) {
+        const int8_t offset = exact ? 0 : digipots[i].offset;
+        ok = (i2c_start(digipots[i].address) == 0
+              && (!config || i2c_write(DS1882_CONFIG) == 0)
+              && i2c_write((0 << 6) | clamp_wiper(left + offset)) == 0
+              && i2c_write((1 << 6) | clamp_wiper(right + offset)) == 0)
+            && ok;
+    }
+    i2c_stop();
+#if DIGIPOT_VERIFY
+    // The DS1882 returns both wiper registers and the configuration
+    // register, each with its command bits on top as written.
+    for (uint8_t i = 0; ok && i < DIGIPOT_COUNT; ++i) {
+        const int8_t offset = exact ? 0 : digipots[i].offset;
+        uint8_t data[3];
+        ok = (i2c_receive(digipots[i].address | I2C_READ, data, 3) == 0
+              && data[0] == ((0 << 6) | clamp_wiper(left + offset))
+              && data[1] == ((1 << 6) | clamp_wiper(right + offset))
+              && (!config || data[2] == DS1882_CONFIG));
+    }
+#endif
+    return ok;
+}
+
+// Sets the pots to 63 step mode and both wipers to full attenuation, so that
+// whatever the chips powered up with is replaced as early as possible.
+// Tries to recover the bus if that fails.
 void ds1882_init() {
-    if (i2c_start(DIGIPOT_WRITE) == 0) {
-        i2c_write(0x86);  // set to 63 step mode.
-        i2c_stop();
+    for (uint8_t i = 0; i <= I2C_RETRIES; ++i) {
+        if (ds1882_write(63, 63, true, true))
+            return;
+        i2c_recover();
     }
 }
 
-uint8_t value_mapping[30] = {
-    0,  1, 2, 3, 4, 5,   // 1 step.
-    7,  9, 11, 13, 15, 17, 19, 21, 23, 25, 27, 31, 33, 35, 37, 39,  // 2 step.
-    42, 45, 48, 51, 54, 57, 60, 63  // 3 step.
-};
-void ds1882_set_pot_value(uint8_t value, bool muted) {
-    if (muted) value = 0;
+// Balance is -BALANCE_MAX (left) .. BALANCE_MAX (right).
+static int8_t wiper_balance;
 
-    // Value can be 0..29. The DS1882 has a range 0..63 with the
-    // highest value being the most attenuation.
-    uint8_t wiper = 63 - value_mapping[value];
+static int8_t tracking_correction(uint8_t value) {
+    if (eeprom_read_byte(&ee_data.tracking_magic) != TRACKING_MAGIC)
+        return 0;
+    const uint8_t b = eeprom_read_byte(&ee_data.tracking[value / 2]);
+    const int8_t nibble = (value & 1) ? (b >> 4) : (b & 0x0f);
+    return nibble > 7 ? nibble - 16 : nibble;
+}
 
-    if (i2c_start(DIGIPOT_WRITE) == 0) {
-        i2c_write((0 << 6) | wiper);
-        i2c_write((1 << 6) | wiper);
-        i2c_stop();
+// Returns false if not all pots could be set.
+bool ds1882_set_pot_value(uint8_t value, bool muted) {
+    // Value can be 0..29.
+    BENCH_BEGIN(BENCH_POT_UPDATE);
+    bool ok;
+    if (muted) {
+        ok = ds1882_write(63, 63, true, false);
+    } else {
+        // The DS1882 has a range 0..63 with the highest value being the
+        // most attenuation. Balance and tracking are applied here rather
+        // than kept in a table: a few cycles against the I2C transfer,
+        // and no SRAM.
+        const int16_t wiper = 63 - tuning.value_mapping[value];
+        const int16_t right = wiper + tracking_correction(value);
+        ok = ds1882_write(
+            clamp_wiper(wiper_balance > 0 ? wiper + wiper_balance : wiper),
+            clamp_wiper(wiper_balance < 0 ? right - wiper_balance : right),
+            false, false);
     }
+    BENCH_END(BENCH_POT_UPDATE);
+    return ok;
 }
 
+// Sets the pots and, if that fails, keeps retrying from Poll() with
+// exponential backoff, so that a glitch on the bus costs a retry instead of
+// leaving the pots at a different volume than the LEDs show.
+class PotWriter {
+public:
+    PotWriter() : retries_left_(0), errors_(0), failures_(0) {}
+
+    void Set(uint8_t value, bool muted, Clock::cycle_t now) {
+        value_ = value;
+        muted_ = muted;
+        retries_left_ = I2C_RETRIES;
+        backoff_ = Clock::ms_to_cycles(I2C_RETRY_MS);
+        Attempt(now);
+    }
+
+    // Call regularly; retries a failed write when its backoff has passed.
+    void Poll(Clock::cycle_t now) {
+        if (retries_left_ == 0 || now - last_attempt_ < backoff_)
+            return;
+        --retries_left_;
+        backoff_ <<= 1;
+        Attempt(now);
+    }
+
+    // Number of failed writes and of pot values given up on.
+    uint16_t errors() const { return errors_; }
+    uint16_t failures() const { return failures_; }
+
+private:
+    void Attempt(Clock::cycle_t now) {
+        if (ds1882_set_pot_value(value_, muted_)) {
+            retries_left_ = 0;
+            return;
+        }
+        ++errors_;
+        if (retries_left_ == 0)
+            ++failures_;
+        i2c_recover();
+        last_attempt_ = now;
+    }
+
+    uint8_t value_;
+    bool muted_;
+    uint8_t retries_left_;
+    Clock::cycle_t backoff_;
+    Clock::cycle_t last_attempt_;
+    uint16_t errors_;
+    uint16_t failures_;
+};
+
+// Moves the volume to a recalled preset one knob position at a time. If
+// the knob or the remote change the volume in the meantime, that wins.
+class PresetRamp {
+public:
+    PresetRamp() : target_(-1) {}
+
+    void Start(int8_t target, int16_t pos, Clock::cycle_t now) {
+        target_ = target;
+        pos_ = pos;
+        last_step_ = now - Clock::ms_to_cycles(PRESET_RAMP_STEP_MS);
+    }
+
+    // Returns the volume "pos" should be now.
+    int16_t Update(int16_t pos, Clock::cycle_t now) {
+        if (target_ < 0
+            || now - last_step_ < Clock::ms_to_cycles(PRESET_RAMP_STEP_MS))
+            return pos;
+        if (pos != pos_ || pos == target_) {
+            target_ = -1;  // Done, or somebody else took over.
+            return pos;
+        }
+        pos += (target_ > pos) ? 1 : -1;
+        pos_ = pos;
+        last_step_ = now;
+        return pos;
+    }
+
+private:
+    int8_t target_;   // -1: idle.
+    int16_t pos_;     // Where we left the volume.
+    Clock::cycle_t last_step_;
+};
+
 inline static uint8_t GetEEValue(uint8_t* which) { return eeprom_read_byte(which); }
 inline static uint8_t SetEEValue(uint8_t* which, uint8_t value) {
   eeprom_write_byte(which, value);
   return value;
 }
 
+// Returns if "value" is in range for tuning parameter "key" (see the console
+// 's' command). The decoder timeouts are up to 12 times the bit threshold
+// and need to fit in 16 bits; the blink mask needs to be 2^n - 1.
+static bool TuningValueOk(char key, uint16_t value) {
+    switch (key) {
+    case 't': return value >= 0x100 && value <= 0x1000;
+    case 'd': return value >= 5 && value <= 200;
+    case 'e': return value >= 100;
+    case 'b': return value >= 0x3ff && (value & (value + 1)) == 0;
+    }
+    return false;
+}
+
+// Load tuning from EEPROM if there is a block of our version, otherwise
+// use the compiled-in defaults.
+static void LoadTuning() {
+    LoadDefaultTuning();
+    TuningBlock block;
+    eeprom_read_block(&block, &ee_data.tuning, sizeof(block));
+    if (block.version != TUNING_VERSION
+        || !TuningValueOk('t', block.ir_bit_threshold)
+        || !TuningValueOk('d', block.button_debounce_ms)
+        || !TuningValueOk('e', block.eeprom_delay_ms)
+        || !TuningValueOk('b', block.blink_mask))
+        return;
+    tuning.ir_bit_threshold = block.ir_bit_threshold;
+    tuning.button_debounce_ms = block.button_debounce_ms;
+    tuning.eeprom_delay_ms = block.eeprom_delay_ms;
+    tuning.blink_mask = block.blink_mask;
+    uint8_t value = block.mapping_base;
+    for (uint8_t i = 0; i < 30; ++i) {
+        if (i > 0) {
+            const uint8_t steps = block.mapping_steps[(i - 1) / 2];
+            value += ((i - 1) & 1) ? steps >> 4 : steps & 0x0f;
+        }
+        tuning.value_mapping[i] = value;
+    }
+}
+
+// Save tuning to EEPROM. Returns false if the value mapping can't be
+// stored: it needs to go up in steps of at most 15.
+static bool SaveTuning() {
+    TuningBlock block;
+    block.version = TUNING_VERSION;
+    block.ir_bit_threshold = tuning.ir_bit_threshold;
+    block.button_debounce_ms = tuning.button_debounce_ms;
+    block.eeprom_delay_ms = tuning.eeprom_delay_ms;
+    block.blink_mask = tuning.blink_mask;
+    block.mapping_base = tuning.value_mapping[0];
+    for (uint8_t i = 1; i < 30; ++i) {
+        const uint8_t steps = tuning.value_mapping[i] - tuning.value_mapping[i-1];
+        if (steps > 15)
+            return false;   // Also catches going down.
+        if ((i - 1) & 1)
+            block.mapping_steps[(i - 1) / 2] |= steps << 4;
+        else
+            block.mapping_steps[(i - 1) / 2] = steps;
+    }
+    block.mapping_steps[14] &= 0x0f;  // unused nibble.
+    eeprom_update_block(&block, &ee_data.tuning, sizeof(block));
+    return true;
+}
+
+#if DO_SERIAL_COM
+struct Stats {
+    uint16_t ir_frames;     // Frames for us.
+    uint16_t ir_foreign;    // Frames for another receiver.
+    uint16_t ir_bad_check;  // Frames with bit errors.
+};
+
+static void PrintValue(SerialCom *com, const char *name, uint16_t value) {
+    PrintString(com, name);
+    PrintString(com, " 0x");
+    printHexByte(com, value >> 8);
+    printHexByte(com, value & 0xff);
+    PrintString(com, "\r\n");
+}
+
+// Tuning console. Commands:
+//   p             print parameters
+//   s <k> <value> set parameter: t ir bit threshold (0x100..0x1000),
+//                 d debounce ms (5..200), e eeprom write delay ms (>= 100),
+//                 b blink mask (2^n - 1, >= 0x3ff)
+//   m <pos> <val> set value mapping of knob position
+//   w             write parameters to EEPROM
+//   r             revert to compiled-in defaults
+//   i             statistics
+//   l             latency histograms; 'll' also clears them
+// Numbers are decimal or 0x-hex. Returns true if tuning changed.
+static bool HandleConsoleLine(const char *line, SerialCom *com,
+                              const Stats &stats, uint16_t ir_backoffs,
+                              const PotWriter &pots) {
+    uint16_t pos, value;
+    const char *arg;
+    switch (line[0]) {
+    case 'p':
+        PrintValue(com, "t", tuning.ir_bit_threshold);
+        PrintValue(com, "d", tuning.button_debounce_ms);
+        PrintValue(com, "e", tuning.eeprom_delay_ms);
+        PrintValue(com, "b", tuning.blink_mask);
+        PrintString(com, "m");
+        for (uint8_t i = 0; i < 30; ++i) {
+            com->write(' ');
+            printHexByte(com, tuning.value_mapping[i]);
+        }
+        PrintString(com, "\r\n");
+        return false;
+    case 's':
+        arg = line + 2;
+        if (line[1] != ' ' || !ParseNumber(arg + 1, &value)
+            || !TuningValueOk(*arg, value))
+            break;
+        switch (*arg) {
+        case 't': tuning.ir_bit_threshold = value; return true;
+        case 'd': tuning.button_debounce_ms = value; return true;
+        case 'e': tuning.eeprom_delay_ms = value; return true;
+        case 'b': tuning.blink_mask = value; return true;
+        }
+        break;
+    case 'm':
+        arg = ParseNumber(line + 1, &pos);
+        if (!arg || pos >= 30 || !ParseNumber(arg, &value) || value > 63)
+            break;
+        tuning.value_mapping[pos] = value;
+        return true;
+    case 'w':
+        PrintString(com, SaveTuning() ? "ok\r\n" : "err map\r\n");
+        return false;
+    case 'r':
+        LoadDefaultTuning();
+        return true;
+    case 'i':
+        PrintValue(com, "frames", stats.ir_frames);
+        PrintValue(com, "foreign", stats.ir_foreign);
+        PrintValue(com, "bad check", stats.ir_bad_check);
+        PrintValue(com, "backoff", ir_backoffs);
+        PrintValue(com, "rxdrop", com->dropped_rx());
+        PrintValue(com, "i2c err", pots.errors());
+        PrintValue(com, "i2c fail", pots.failures());
+        PrintValue(com, "i2c timeout", i2c_timeouts);
+        return false;
+    case 'l':
+        for (uint8_t i = 0; i < LATENCY_STAGES; ++i) {
+            PrintString(com, i == LATENCY_DECODE ? "decode" : "pot");
+            for (uint8_t b = 0; b < LATENCY_BUCKETS; ++b) {
+                com->write(' ');
+                printHexByte(com, latency[i][b]);
+                if (line[1] == 'l') latency[i][b] = 0;
+            }
+            PrintString(com, "\r\n");
+        }
+        return false;
+    }
+    PrintString(com, "?\r\n");
+    return false;
+}
+#endif
+
+// Apply changed tuning parameters to the things that derived values from
+// them. Returns the EEPROM write delay in clock cycles.
+static Clock::long_cycle_t ApplyTuning(DebouncedButton *button) {
+    button->set_debounce(Clock::ms_to_cycles(tuning.button_debounce_ms));
+    return Clock::ms_to_long_cycles(tuning.eeprom_delay_ms);
+}
+
+// Pairing and learn mode end after "ms" without progress.
+static inline void SetModeTimeout(uint16_t ms) {
+    Clock::set_alarm(Clock::ALARM_B,
+                     Clock::now32() + Clock::ms_to_long_cycles(ms));
+}
+
 int main() {
-    InitLedData();
+    BENCH_BEGIN(BENCH_BOOT_TO_READY);
+    // Timer starts at reset, so Clock::now() is the time since then.
+    // Deadlines further out than a few seconds are alarms: ALARM_A writes
+    // the EEPROM, ALARM_B ends pairing and learn mode.
     Clock::init();
     i2c_init();
     ds1882_init();
+    InitLedData();
+    LoadTuning();
+    learned_codes.Load();
 
     // Set pullups.
     IR_PORT_OUT |= IR_IN;
     BUTTON_PORT_OUT |= BUTTON_IN;
     QUAD_PORT_OUT |= QUAD_IN;
+#if LATENCY_MARKERS
+    LATENCY_DDR |= LATENCY_BIT;
+#endif
+    _delay_us(100);  // Let the pullups charge the lines.
+    if (button_in()) {
+        pairing_mode = true;
+        SetModeTimeout(PAIRING_TIMEOUT_MS);
+    }
 
     SerialCom com;
     QuadDecoder knob(quad_in());
-    DebouncedButton button;
+    DebouncedButton button(Clock::ms_to_cycles(BUTTON_DEBOUNCE_MS),
+                           Clock::ms_to_cycles(BUTTON_LONG_PRESS_MS),
+                           Clock::ms_to_cycles(BUTTON_DOUBLE_PRESS_MS));
+    InfraredGuard ir_guard;
+    PotWriter pots;
+    PresetRamp preset_ramp;
     uint8_t buffer[4];
+    uint8_t last_frame_device = 0;
+    uint8_t last_frame_sequence = 0;
+    Clock::cycle_t last_frame_time = Clock::now() - Clock::ms_to_cycles(IR_DEDUP_MS);
+#if DO_SERIAL_COM
+    LineReader console;
+    Stats stats = { 0, 0, 0 };
+#endif
 
     // Set initial values we have kept in EEPROM
     int16_t pot_pos = GetEEValue(&ee_data.value);
@@ -268,53 +931,284 @@ int main() {
     // we're in range.
     if (pot_pos < 0 || pot_pos > 29)
         pot_pos = 0;
+    int8_t balance = GetEEValue(&ee_data.balance) - BALANCE_CENTER;
+    if (balance < -BALANCE_MAX || balance > BALANCE_MAX)
+        balance = 0;
+    wiper_balance = balance;
+    Clock::long_cycle_t eeprom_write_delay = ApplyTuning(&button);
+    paired_device = GetEEValue(&ee_data.paired_device);
+    uint8_t learn_step = LEARN_NONE;  // Action to be learned next.
+    bool balance_shown = false;
+    Clock::cycle_t balance_shown_start = 0;
 
-    ds1882_set_pot_value(pot_pos, muted);
+    // The button toggles mute on release, unless it was used to turn
+    // the knob for balance. A long press toggles learn mode instead.
+    bool button_used = false;
+    bool long_press = false;
+    bool boot_press = pairing_mode;   // Its release doesn't mute.
+    bool learn_replace = false;  // Old codes go with the first new one.
+    bool learn_dirty = false;    // New codes, saved on confirm.
 
-    bool change_needs_writing = false;
-    Clock::cycle_t change_needs_writing_start;
+    // We start at full attenuation and only let the pot go up to
+    // ramp_limit, which is raised until it reaches the top.
+    uint8_t ramp_limit = 0;
+    Clock::cycle_t ramp_step_start = Clock::now();
+    bool audio_ready = false;
 
     // The optical encoder needs some settle-time it seems. Discard changes
-    // until we see 100ms of no change.
+    // until we see ENCODER_SETTLE_MS of no change.
+    bool knob_settled = false;
     Clock::cycle_t last_encoder_change = Clock::now();
-    while (Clock::now() - last_encoder_change < Clock::ms_to_cycles(100)) {
-        if (knob.UpdateEnoderState(quad_in()) != 0)
-            last_encoder_change = Clock::now();
-    }
 
     for (;;) {
+        BENCH_BEGIN(BENCH_MAIN_LOOP);
         int16_t old_pos = pot_pos;
+        bool ir_command = false;    // This pass handles an IR command.
+        Clock::cycle_t ir_decoded = 0;
+        int16_t balance_diff = 0;   // Any 'b' argument plus the knob.
 
-        if (button.DetectEdge(button_in())) {
-            muted = !muted;
-            old_pos = -1;  // force redraw
+        if (ramp_limit < 29 && Clock::now() - ramp_step_start
+            >= Clock::ms_to_cycles(BOOT_RAMP_STEP_MS)) {
+            ++ramp_limit;
+            ramp_step_start = Clock::now();
+            if (ramp_limit <= pot_pos && !muted)
+                pots.Set(ramp_limit, muted, Clock::now());
+        }
+        pot_pos = preset_ramp.Update(pot_pos, Clock::now());
+        if (!audio_ready && (muted || ramp_limit >= pot_pos)) {
+            // Pot is where it should be.
+            audio_ready = true;
+            BENCH_END(BENCH_BOOT_TO_READY);
+#if DO_SERIAL_COM
+            const Clock::cycle_t boot_time = Clock::now();
+            PrintString(&com, "ready after 0x");  // in 128us clock ticks.
+            printHexByte(&com, boot_time >> 8);
+            printHexByte(&com, boot_time & 0xff);
+            PrintString(&com, "\r\n");
+#endif
         }
 
-        if (!infrared_in() && read_infrared(buffer, &com) == 4) {
-            // Our sender.
-            if (buffer[0] == 'm' && buffer[1] == 'o' && buffer[2] == 'r' && buffer[3] == 'e') {
-                ++pot_pos;
+        switch (button.Update(button_in(), Clock::now())) {
+        case DebouncedButton::PRESS:
+        case DebouncedButton::DOUBLE_PRESS:  // Just another press.
+            button_used = boot_press;
+            boot_press = false;
+            long_press = false;
+            break;
+        case DebouncedButton::LONG_PRESS:
+            long_press = true;  // Acted on at release.
+            break;
+        case DebouncedButton::RELEASE:  // Each press toggles.
+            if (button_used) {
+                // Balance.
             }
-            else if (buffer[0] == 'l' && buffer[1] == 'e' && buffer[2] == 's' && buffer[3] == 's') {
-                --pot_pos;
+            else if (long_press) {
+                learn_mode = !learn_mode;
+                if (learn_mode) {
+                    pairing_mode = false;
+                    learn_replace = true;
+                    learn_dirty = false;
+                    learn_step = LEARN_UP;
+                    SetModeTimeout(LEARN_TIMEOUT_MS);
+                }
+                else if (learn_dirty) {
+                    learned_codes.Save();  // Confirmed.
+                }
+                old_pos = -1;
+            }
+            else if (learn_mode) {
+                if (learn_step < LEARN_ACTION_COUNT)
+                    ++learn_step;  // Skip this one.
+                SetModeTimeout(LEARN_TIMEOUT_MS);
             }
-            else if (buffer[0] == 'b' && buffer[1] == '_' && buffer[2] == 'o' && buffer[3] == 'n') {
+            else {
                 muted = !muted;
+                old_pos = -1;  // force redraw
+            }
+            break;
+        default:
+            break;
+        }
+
+        if (Clock::fired(Clock::ALARM_B)) {  // Pairing or learn timeout.
+            if (learn_mode && learn_dirty)
+                learned_codes.Load();  // Not confirmed.
+            pairing_mode = false;
+            learn_mode = false;
+            old_pos = -1;
+        }
+
+        if (!infrared_in() && ir_guard.enabled(Clock::now())) {
+            const Clock::cycle_t frame_start = Clock::now();
+            LATENCY_HIGH();
+            const uint8_t read = read_infrared(buffer, &com);
+            LATENCY_LOW();
+            ir_decoded = Clock::now();
+            bool got_frame = (read == 4);
+            if (read == IR_FOREIGN_FRAME) {
+                ir_guard.ForeignFrame(Clock::now());
+#if DO_SERIAL_COM
+                ++stats.ir_foreign;
+#endif
+            }
+            else if (ir_guard.Report(got_frame, !infrared_in(), Clock::now())) {
+#if DO_SERIAL_COM
+                PrintString(&com, "IR backoff\r\n");
+#endif
+            }
+            uint8_t learned = LEARN_NONE;
+            if (got_frame)
+                learned = learned_codes.Find(buffer);
+            // Codes of other remotes don't have our check nibble.
+            if (got_frame && learned == LEARN_NONE && !learn_mode
+                && !frame_check_ok(buffer)) {
+                got_frame = false;  // Bit error; maybe the copy makes it.
+#if DO_SERIAL_COM
+                ++stats.ir_bad_check;
+#endif
+            }
+            if (got_frame) {
+                const uint16_t dedup_ms = (learned == LEARN_NONE)
+                    ? IR_DEDUP_MS : IR_LEARNED_DEDUP_MS;
+                const bool is_copy = (buffer[0] == last_frame_device &&
+                                      buffer[3] == last_frame_sequence &&
+                                      Clock::now() - last_frame_time
+                                      < Clock::ms_to_cycles(dedup_ms));
+                last_frame_device = buffer[0];
+                last_frame_sequence = buffer[3];
+                last_frame_time = Clock::now();
+                if (is_copy)
+                    got_frame = false;
+            }
+            if (got_frame) {
+                ir_command = true;
+                RecordLatency(LATENCY_DECODE, ir_decoded - frame_start);
+            }
+            // Our remotes keep working in learn mode; once all actions
+            // are through, only the confirm is left.
+            if (got_frame && learn_mode && !is_own_frame(buffer)) {
+                if (learn_step < LEARN_ACTION_COUNT) {
+                    if (learn_replace) {
+                        learned_codes.Clear();
+                        learn_replace = false;
+                    }
+                    learned_codes.Add(buffer,
+                                      LEARN_ACTION(learn_step, pot_pos));
+                    learn_dirty = true;
+                    ++learn_step;
+                    SetModeTimeout(LEARN_TIMEOUT_MS);
+                }
+            }
+            else if (got_frame && learned != LEARN_NONE) {
+                switch (learned >> 5) {
+                case LEARN_UP:        pot_pos += LEARN_COARSE_STEP; break;
+                case LEARN_DOWN:      pot_pos -= LEARN_COARSE_STEP; break;
+                case LEARN_FINE_UP:   ++pot_pos; break;
+                case LEARN_FINE_DOWN: --pot_pos; break;
+                case LEARN_PRESET:
+                    preset_ramp.Start(learned & 0x1f, pot_pos, Clock::now());
+                    break;
+                case LEARN_MUTE:
+                    muted = !muted;
+                    old_pos = -1;
+                    break;
+                }
+            }
+            else if (got_frame && pairing_mode && buffer[1] == 'd') {
+                // Only a double press pairs, so that a remote that just
+                // happens to send something doesn't.
+                paired_device = SetEEValue(&ee_data.paired_device, buffer[0]);
+                pairing_mode = false;
                 old_pos = -1;
             }
+            else if (got_frame && (paired_device == 0xff
+                                   || buffer[0] == paired_device)) {
+#if DO_SERIAL_COM
+                ++stats.ir_frames;
+#endif
+                // Our sender: [device id][command][argument][seq|check]
+                switch (buffer[1]) {
+                case 'm': ++pot_pos; break;
+                case 'l': --pot_pos; break;
+                case 'p':   // Button clicked. A double press ('d') pairs.
+                    muted = !muted;
+                    old_pos = -1;
+                    break;
+                case 'b':   // Balance change in argument.
+                    balance_diff += (int8_t) buffer[2];
+                    break;
+                case 's':   // Store preset; long press on the remote.
+                    if (buffer[2] < PRESET_SLOTS)
+                        SetEEValue(&ee_data.presets[buffer[2]], pot_pos);
+                    break;
+                case 'g': { // Go to preset.
+                    const uint8_t preset = (buffer[2] < PRESET_SLOTS)
+                        ? GetEEValue(&ee_data.presets[buffer[2]]) : 0xff;
+                    if (preset <= 29) {
+                        preset_ramp.Start(preset, pot_pos, Clock::now());
+                        muted = false;
+                        old_pos = -1;
+                    }
+                    break;
+                }
+                }
+            }
         }
 
 #if DO_SERIAL_COM && defined(HISTOGRAM_SHIFT)
         for (int i = 0; i < 255; ++i) histogram[i] = 0;
 #endif
 
-        pot_pos += knob.UpdateEnoderState(quad_in());
+#if DO_SERIAL_COM
+        if (console.Poll(&com) &&
+            HandleConsoleLine(console.line(), &com, stats,
+                              ir_guard.backoff_count(), pots)) {
+            eeprom_write_delay = ApplyTuning(&button);
+            old_pos = -1;  // force pot update with new mapping.
+        }
+#endif
+
+        const int8_t knob_diff = knob.UpdateEnoderState(quad_in());
+        if (knob_settled) {
+            if (button.is_pressed()) {
+                balance_diff += knob_diff;
+                if (knob_diff != 0) button_used = true;
+            } else {
+                pot_pos += knob_diff;
+            }
+        } else if (knob_diff != 0) {
+            last_encoder_change = Clock::now();
+        } else if (Clock::now() - last_encoder_change
+                   >= Clock::ms_to_cycles(ENCODER_SETTLE_MS)) {
+            knob_settled = true;
+        }
 
         if (pot_pos < 0) pot_pos = 0;
         if (pot_pos > 29) pot_pos = 29;
 
+        if (balance_diff != 0) {
+            int16_t new_balance = balance + balance_diff;
+            if (new_balance < -BALANCE_MAX) new_balance = -BALANCE_MAX;
+            if (new_balance > BALANCE_MAX) new_balance = BALANCE_MAX;
+            balance = new_balance;
+            wiper_balance = balance;
+            balance_shown = true;
+            balance_shown_start = Clock::now();
+            old_pos = -1;  // force pot update.
+        }
+        if (balance_shown && Clock::now() - balance_shown_start
+            > Clock::ms_to_cycles(BALANCE_DISPLAY_MS)) {
+            balance_shown = false;
+        }
+
         if (old_pos != pot_pos) {
-            ds1882_set_pot_value(pot_pos, muted);
+            pots.Set(pot_pos < ramp_limit ? pot_pos : ramp_limit, muted,
+                     Clock::now());
+            if (ir_command) {
+                LATENCY_HIGH();
+                LATENCY_LOW();
+                RecordLatency(LATENCY_POT, Clock::now() - ir_decoded);
+            }
 #if DO_SERIAL_COM
             com.write((pot_pos / 10) + '0');
             com.write((pot_pos % 10) + '0');
@@ -323,25 +1217,44 @@ int main() {
             com.write('\r');
             com.write('\n');
 #endif
-            change_needs_writing = true;
-            change_needs_writing_start = Clock::now();
+            Clock::set_alarm(Clock::ALARM_A,
+                             Clock::now32() + eeprom_write_delay);
+        } else {
+            pots.Poll(Clock::now());
         }
 
-        bool is_on = !muted || ((Clock::now() & 0x1FFF) < 0xFFF);
-        led_output(pot_pos, is_on);
+        bool is_on = !muted ||
+            ((Clock::now() & tuning.blink_mask) < (tuning.blink_mask >> 1));
+        if (pairing_mode) {
+            led_output((Clock::now() >> 9) % 30, true);  // Running light.
+        } else if (learn_mode) {
+            // Blinking: top, bottom, center, upper and lower third, and
+            // the current volume for the preset; fast when all are through
+            // and we wait for the confirm.
+            static const uint8_t kLearnLed[] = { 29, 0, 14, 19, 9 };
+            const uint8_t blink_shift =
+                (learn_step == LEARN_ACTION_COUNT) ? 9 : 11;
+            led_output(learn_step >= LEARN_PRESET
+                       ? pot_pos : kLearnLed[learn_step - LEARN_UP],
+                       (Clock::now() >> blink_shift) & 1);
+        } else {
+            led_output(balance_shown ? 14 + balance : pot_pos, is_on);
+        }
 
         // Write current setting to eeprom, but only after it has been settled
         // for a while not to wear out the eeprom.
-        if (change_needs_writing &&
-            (Clock::now() - change_needs_writing_start > Clock::ms_to_cycles(1000))) {
+        if (Clock::fired(Clock::ALARM_A)) {
+            BENCH_BEGIN(BENCH_EEPROM_FLUSH);
             SetEEValue(&ee_data.value, pot_pos);
             SetEEValue(&ee_data.is_muted, muted);
+            SetEEValue(&ee_data.balance, balance + BALANCE_CENTER);
+            BENCH_END(BENCH_EEPROM_FLUSH);
 #if DO_SERIAL_COM
             com.write('w');
             com.write('\r');
             com.write('\n');
 #endif
-            change_needs_writing = false;
         }
+        BENCH_END(BENCH_MAIN_LOOP);
     }
 }
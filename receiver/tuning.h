@@ -0,0 +1,38 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * Copyright (c) h.zeller@acm.org. GNU public License.
+ */
+
+#ifndef TUNING_H_
+#define TUNING_H_
+
+#include <stdint.h>
+
+// Parameters that used to be compile-time constants. They can be changed
+// at runtime from the serial console and are kept in a versioned block in
+// EEPROM. The compiled-in values are the defaults.
+struct Tuning {
+  uint16_t ir_bit_threshold;   // Decoder loop counts; see ir-decoder.h
+  uint8_t button_debounce_ms;
+  uint16_t eeprom_delay_ms;    // Settle time before the volume is saved.
+  uint16_t blink_mask;         // Mute blink period in clock ticks, 2^n - 1.
+  uint8_t value_mapping[30];   // Knob position to DS1882 attenuation steps.
+};
+
+// What we store in EEPROM, 24 bytes. The value mapping is stored as steps to
+// keep it small: the ATtiny48 only has 64 bytes.
+// Bump TUNING_VERSION if this changes; a block with a different version is
+// ignored.
+#define TUNING_VERSION 1
+struct TuningBlock {
+  uint8_t version;
+  uint16_t ir_bit_threshold;
+  uint8_t button_debounce_ms;
+  uint16_t eeprom_delay_ms;
+  uint16_t blink_mask;
+  uint8_t mapping_base;        // value_mapping[0]
+  uint8_t mapping_steps[15];   // Increments, one nibble each, low first.
+};
+
+extern struct Tuning tuning;
+
+#endif  // TUNING_H_
@@ -0,0 +1,32 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * Copyright (c) h.zeller@acm.org. GNU public License.
+ */
+
+#ifndef BENCH_H_
+#define BENCH_H_
+
+#include <avr/io.h>
+
+// Markers for 'make bench'. The image built with -DBENCH=1 writes the marker
+// to GPIOR0 and the simulator (sim/avr-bench) notes the cycle count. Regular
+// builds don't contain any of it.
+// The numbers are shared with the receiver and sim/avr-bench.c
+enum BenchMarker {
+  BENCH_ISR           = 1,  // Interrupt handler entry to exit.
+  BENCH_MAIN_LOOP     = 2,  // One pass through the main loop.
+  BENCH_IR_DECODE     = 3,
+  BENCH_POT_UPDATE    = 4,
+  BENCH_EEPROM_FLUSH  = 5,
+  BENCH_WAKE_TO_BURST = 6,  // Wake-up from sleep until the first IR burst.
+  BENCH_BOOT_TO_READY = 7,  // Reset until the pot is at the saved volume.
+};
+
+#if BENCH
+#  define BENCH_BEGIN(marker) GPIOR0 = (marker)
+#  define BENCH_END(marker)   GPIOR0 = (marker) | 0x80
+#else
+#  define BENCH_BEGIN(marker) do {} while (0)
+#  define BENCH_END(marker)   do {} while (0)
+#endif
+
+#endif  // BENCH_H_
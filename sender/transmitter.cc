@@ -10,10 +10,13 @@
  */
 
 #include <avr/io.h>
+#include <avr/eeprom.h>
 #include <avr/interrupt.h>
 #include <avr/sleep.h>
 #include <avr/power.h>
 
+#include "bench.h"
+#include "button.h"
 #include "quad.h"
 
 // Do direct pullup for the quad encoder. However, these are relatively low
@@ -26,22 +29,109 @@
 // in that mode.
 #define SLEEP_AFTER_TRANSMIT 1
 
-// We need to fudge up the frequency a bit because the RC oscillator runs
-// a little slower at 3V.
-#define IR_FREQ         (38000 * 1.0387)  // Frequency of IR carrier
+// The RC oscillator runs a little slower at 3V, and drifts with battery
+// voltage and temperature. With OSC_CALIBRATION, we measure it against the
+// watchdog oscillator at boot and after every OSC_CALIBRATION_FRAMES
+// commands, once the remote is idle, and step OSCCAL until it matches.
+// The watchdog oscillator is not precise either, but doesn't drift the
+// same way; WDT_CLOCK_HZ can be set to what it was measured at on a board.
+// Without calibration, we need to fudge up the frequency a bit instead.
+#ifndef OSC_CALIBRATION
+#  define OSC_CALIBRATION 1
+#endif
+#ifndef WDT_CLOCK_HZ
+#  define WDT_CLOCK_HZ 128000
+#endif
+#define OSC_CALIBRATION_FRAMES  32
+#define OSC_CALIBRATION_STEPS   8
+// Timer1 counts at clk/8 during one watchdog period of 2048 cycles.
+#define OSC_TARGET_COUNT  ((uint16_t)(F_CPU / 8.0 * 2048 / WDT_CLOCK_HZ))
+
+#if OSC_CALIBRATION
+#  define IR_FREQ         38000             // Frequency of IR carrier
+#else
+#  define IR_FREQ         (38000 * 1.0387)  // Frequency of IR carrier
+#endif
 
 // Need double transmit frequency for one cycle
 #define CLOCK_COUNTER   F_CPU / (2.0 * IR_FREQ)
 
+// With SEND_ISR_ASM, the timer interrupts are the hand-written assembly
+// below instead of C. Its cycle counts are from the datasheet; it stays off
+// until they have been checked against the disassembly and 'make bench'
+// ('make isr-check SEND_ISR_ASM=1' shows what is needed).
+#if !defined(SEND_ISR_ASM) || !defined(__AVR__)
+#  undef SEND_ISR_ASM
+#  define SEND_ISR_ASM 0
+#endif
+
+// Duty cycle of the IR carrier. Less than 50% saves LED energy at the same
+// peak current, and the TSOP doesn't mind. No OC0x pin is free for hardware
+// PWM, so below 50% the compare A interrupt switches the LED on every other
+// tick and compare B switches it off again CLOCK_COUNTER_OFF counts later.
+// The interrupts take a different number of cycles from the compare match
+// to the pin (see the ISRs), which we add to compare B.
+#ifndef IR_DUTY_PERCENT
+#  define IR_DUTY_PERCENT 33
+#endif
+#if SEND_ISR_ASM
+#  define IR_LED_ON_CYCLES  14
+#  define IR_LED_OFF_CYCLES  8
+#else
+#  define IR_LED_ON_CYCLES   0   // Not known for the C handlers.
+#  define IR_LED_OFF_CYCLES  0
+#endif
+#define CLOCK_COUNTER_OFF                                                \
+    (((int)(CLOCK_COUNTER) + 1) * 2 * IR_DUTY_PERCENT / 100 - 1        \
+     + IR_LED_ON_CYCLES - IR_LED_OFF_CYCLES)
+#if IR_DUTY_PERCENT < 50
+// Compare B has to match within the timer period, otherwise it never fires
+// and the LED stays on. Fails to compile otherwise (no static_assert in
+// C++98).
+typedef char clock_counter_off_in_range[
+    (CLOCK_COUNTER_OFF > 0 && CLOCK_COUNTER_OFF < (int)(CLOCK_COUNTER))
+    ? 1 : -1];
+#endif
+
 #define IR_OUT_PORT      PORTA
+#define IR_OUT_PORT_IN   PINA      // Writing a one toggles the output.
 #define IR_OUT_DATADIR   DDRA
-#define IR_OUT_BIT       (1<<0)
+#define IR_OUT_PIN       0
+#define IR_OUT_BIT       (1<<IR_OUT_PIN)
 #define IR_DEBUG_BIT     (1<<1)    // Nice to trigger the scope on.
-#define IR_BURST_LEN     (2 * 22)  // 22 cycles. two edges.
-#define IR_INITIAL_BURST (4 * IR_BURST_LEN)
-#define IR_BIT_0_PAUSE    28
-#define IR_BIT_1_PAUSE   105
-#define IR_FINAL_PAUSE   255
+
+// Normally, IR_DEBUG_BIT is high during the initial burst. With
+// LATENCY_MARKERS, it pulses instead when a detent is seen and when the last
+// burst of a frame is out; see the receiver for its side.
+#ifndef LATENCY_MARKERS
+#  define LATENCY_MARKERS 0
+#endif
+#if LATENCY_MARKERS
+#  define DEBUG_BIT_ON()  do {} while (0)
+#  define LATENCY_PULSE() do { IR_OUT_PORT |= IR_DEBUG_BIT;   \
+                               IR_OUT_PORT &= ~IR_DEBUG_BIT; } while (0)
+#else
+#  define DEBUG_BIT_ON()  IR_OUT_PORT |= IR_DEBUG_BIT
+#  define LATENCY_PULSE() do {} while (0)
+#endif
+
+// Timings in ISR ticks (half carrier cycles). They can be overridden from the
+// command line to try faster timings in the host simulation (see sim/).
+#ifndef IR_BURST_LEN
+#  define IR_BURST_LEN     (2 * 22)  // 22 cycles. two edges.
+#endif
+#ifndef IR_INITIAL_BURST
+#  define IR_INITIAL_BURST (4 * IR_BURST_LEN)
+#endif
+#ifndef IR_BIT_0_PAUSE
+#  define IR_BIT_0_PAUSE    28
+#endif
+#ifndef IR_BIT_1_PAUSE
+#  define IR_BIT_1_PAUSE   105
+#endif
+#ifndef IR_FINAL_PAUSE
+#  define IR_FINAL_PAUSE   255
+#endif
 
 #define ROT_PORT_OUT PORTA
 #define ROT_PORT_IN  PINA
@@ -57,16 +147,71 @@
 #define BUT_BIT       (1<<0)   // Also PCINT to wakeup
 #define BUT_INTR      PCINT8
 
-// The commands we send are just a 32 bit values. Make that some text :)
+// The frames we send are just a 32 bit values:
+//   [device id][command][argument][sequence number (4 bit)|check (4 bit)]
+// The receiver only listens to the device ID it is paired with. Commands are
+// letters for easier debugging :) Some are just one bit apart ('m' and 'l'),
+// so the check nibble makes the XOR of all nibbles of the frame zero; the
+// receiver drops frames with a single bit error instead of acting on them.
+// Each frame is sent IR_FRAME_REPEATS times with the same sequence number;
+// the receiver ignores the copies. More repeats get through at longer
+// range, at the cost of airtime and battery.
 #define MK_COMMAND(a, b, c, d) \
         ((uint32_t)a << 24 | (uint32_t)b << 16 | (uint32_t)c << 8 | d)
-#define COMMAND_MORE MK_COMMAND('m', 'o', 'r', 'e')  // Knob turned right
-#define COMMAND_LESS MK_COMMAND('l', 'e', 's', 's')  // Knob turned left
-#define COMMAND_B_ON MK_COMMAND('b', '_', 'o', 'n')  // Button pressed
-#define COMMAND_BOFF MK_COMMAND('b', 'o', 'f', 'f')  // Button released
-#define COMMAND_BHLD MK_COMMAND('b', 'h', 'l', 'd')  // Button kept pressing
-
-// Sending. All happens in an interrupt set up to fire in 2*38kHz
+#define FRAME_NIBBLES(x) ((x) ^ ((x) >> 4))
+#define FRAME_CHECK_BYTE(id, command, arg, seq)                         \
+        (((seq) << 4) | ((FRAME_NIBBLES((id) ^ (command) ^ (arg)) ^ (seq)) & 0x0f))
+#define MK_FRAME(id, command, arg, seq) \
+        MK_COMMAND(id, command, arg, FRAME_CHECK_BYTE(id, command, arg, seq))
+#ifndef IR_FRAME_REPEATS
+#  define IR_FRAME_REPEATS 2
+#endif
+#ifndef __AVR__
+// The host simulation (see sim/) sends like we do by default.
+extern const uint8_t kFrameRepeats = IR_FRAME_REPEATS;
+#endif
+// Between frames, the receiver needs to see the end of the signal
+// (IR_END_OF_SIGNAL, ~9ms); otherwise a lost burst lets it run into the next
+// one. So a frame that is followed by another ends with this many final
+// pauses.
+#define IR_REPEAT_PAUSES 3
+#define COMMAND_MORE 'm'  // Knob turned right
+#define COMMAND_LESS 'l'  // Knob turned left
+#define COMMAND_B_ON 'p'  // Button clicked (sent on release)
+#define COMMAND_BOFF 'r'  // Button released after a long press
+#define COMMAND_BHLD 'h'  // Button kept pressing
+#define COMMAND_BDBL 'd'  // Button pressed twice
+#define COMMAND_PSET 's'  // Store volume in preset slot (argument)
+#define COMMAND_PGET 'g'  // Go to preset slot (argument)
+// The receiver also understands 'b' (balance, signed steps in the
+// argument) from other senders; we don't send it, balance is set on the
+// receiver.
+
+// Presets: keep the button pressed and turn the knob N detents to recall
+// slot N - 1 on release; turn after the long press to store the volume in
+// it instead. One frame instead of a dozen detents. So that these don't
+// toggle mute, a click only sends 'p' on release, once we know it wasn't a
+// preset gesture or a long press.
+#define PRESET_SLOTS 4
+
+// Our device ID, set with 'make DEVICE_ID=0x17 eeprom-flash'. Erased EEPROM
+// reads 0xff; then we use the compiled-in one.
+#ifndef DEVICE_ID
+#  define DEVICE_ID 0x01
+#endif
+uint8_t EEMEM ee_device_id = DEVICE_ID;
+
+// Button timings. While the button is busy, the watchdog wakes us up
+// periodically to provide the time base.
+#define BUTTON_TICK_MS          16    // Watchdog with shortest prescaler.
+#define BUTTON_DEBOUNCE_MS      30
+#define BUTTON_LONG_PRESS_MS   800
+#define BUTTON_DOUBLE_PRESS_MS 400
+#define MS_TO_BUTTON_TICKS(ms) (((ms) + BUTTON_TICK_MS - 1) / BUTTON_TICK_MS)
+
+// Sending. All happens in an interrupt set up to fire in 2*38kHz: the
+// ISR runs through the phases of a frame by itself and continues with the
+// next frame in the queue, so timing doesn't depend on the main loop.
 enum SendState {
     BIT_BURST,   // the burst at the beginning of a bit (longer initially)
     BIT_PAUSE,   // the pause, whose length the bit encodes.
@@ -74,89 +219,330 @@ enum SendState {
     SENDER_IDLE,
 };
 // State used in the ISR. To save time and space, we assign these to global
-// registers.
+// registers; the Makefile keeps the compiler from using them elsewhere. The
+// ISR below tests send_state for zero (BIT_BURST).
+#ifdef __AVR__
 register enum SendState send_state asm("r13");
 register uint8_t countdown asm("r12");
+#else
+// Host simulation (see sim/): no registers to spare there.
+static volatile enum SendState send_state = SENDER_IDLE;
+static volatile uint8_t countdown;
+#endif
 
-static uint32_t data_to_send;
-static uint32_t current_bit;
+// Pause length per bit value: data is encoded in the pause between bursts.
+static const uint8_t kPauseLength[2] = { IR_BIT_0_PAUSE, IR_BIT_1_PAUSE };
 
-// Send a 32Bit value.
-// "value" is the 32 bit value to send, typically just letters for easier
-// debugging :)
-void Send(uint32_t value) {
-    data_to_send = value;
-    current_bit = 0x80000000;
+// Frames waiting to be sent; the one at queue_head is on air. Each is sent
+// "copies" times.
+#define SEND_QUEUE_LEN 4   // Power of two.
+struct QueuedFrame {
+    uint8_t bytes[4];      // Most significant first.
+    uint8_t copies;
+};
+static QueuedFrame send_queue[SEND_QUEUE_LEN];
+static volatile uint8_t queue_head;
+static volatile uint8_t queue_tail;
+
+// The frame on air.
+static const uint8_t *send_byte;
+static uint8_t send_bits;     // Current byte; next bit on top.
+static uint8_t bits_left;
+static uint8_t copies_left;
+static uint8_t pauses_left;
+
+static inline bool IsQueueEmpty(uint8_t head) { return head == queue_tail; }
+
+// Start sending the frame at the queue head.
+static inline void StartFrame() {
+    send_byte = send_queue[queue_head].bytes;
+    send_bits = *send_byte;
+    bits_left = 32;
+    pauses_left = IR_REPEAT_PAUSES;
     send_state = BIT_BURST;
     countdown = IR_INITIAL_BURST;
-    OCR0A = CLOCK_COUNTER;
-    IR_OUT_PORT |= IR_DEBUG_BIT;
-    TCNT0 = 0;
-    TCCR0A = (1<<WGM01);   // OCRA compare. p.83
-    TIMSK0 |= (1<<OCIE0A);  // Go
+    DEBUG_BIT_ON();
 }
 
-void advanceStateBottomHalf();
-
-// Check if sending is done. Needs to be called regularly after a Send()
-// has been issued.
-bool PollIsSendingDone() {
-    if (send_state == SENDER_IDLE)
-        return true;
-    if (countdown == 0)
-        advanceStateBottomHalf();
-    return false;
-}
-
-void advanceStateBottomHalf() {
-    // Note, we need to set the state _before_ setting the countdown.
-    // The interrupt is still running and polling send_state - so this results
-    // in race-conditions.
-    if (send_state == FINAL_PAUSE) {
-        TIMSK0 &= ~(1<<OCIE0A);       // Disable interrupt. We are done.
-        IR_OUT_PORT &= ~(IR_DEBUG_BIT|IR_OUT_BIT);
-        send_state = SENDER_IDLE;  // External observers might be interested.
-    }
-    else if (send_state == BIT_BURST) {  // Just sent burst, now encode data
-        if (current_bit == 0) {
+// Called from the ISR when a phase is over (every IR_BURST_LEN ticks or
+// more); sets up the next one.
+static inline void NextPhase() {
+    if (send_state == BIT_BURST) {  // Just sent burst, now encode data
+        IR_OUT_PORT &= ~(IR_OUT_BIT|IR_DEBUG_BIT);
+        if (bits_left == 0) {
             send_state = FINAL_PAUSE;
-            IR_OUT_PORT &= ~(IR_OUT_BIT|IR_DEBUG_BIT);
             countdown = IR_FINAL_PAUSE;   // Ran out of data. Final pause.
+            LATENCY_PULSE();
         } else {
             send_state = BIT_PAUSE;
-            IR_OUT_PORT &= ~(IR_OUT_BIT);
-            // Data is encoded in the pause between the bursts.
-            countdown = (current_bit & data_to_send)
-                ? IR_BIT_1_PAUSE
-                : IR_BIT_0_PAUSE;
+            countdown = kPauseLength[send_bits >> 7];
         }
     }
-    else {
+    else if (send_state == BIT_PAUSE) {
         send_state = BIT_BURST;
         countdown = IR_BURST_LEN;
-        current_bit >>= 1;
+        send_bits <<= 1;
+        if ((--bits_left & 7) == 0)
+            send_bits = *++send_byte;  // After the last, reads 'copies'.
     }
+    else {
+        // Final pause. If another frame follows, we need IR_REPEAT_PAUSES
+        // of them, so that the receiver sees the end of this one.
+        uint8_t head = queue_head;
+        const bool more = copies_left != 0
+            || !IsQueueEmpty((head + 1) & (SEND_QUEUE_LEN - 1));
+        if (more && --pauses_left != 0) {
+            countdown = IR_FINAL_PAUSE;   // More of it.
+        }
+        else if (copies_left != 0) {
+            --copies_left;
+            StartFrame();
+        }
+        else {
+            head = (head + 1) & (SEND_QUEUE_LEN - 1);
+            queue_head = head;
+            if (!IsQueueEmpty(head)) {
+                copies_left = send_queue[head].copies - 1;
+                StartFrame();
+            } else {
+                TIMSK0 &= ~((1<<OCIE0A)|(1<<OCIE0B));  // Disable. We are done.
+                IR_OUT_PORT &= ~(IR_DEBUG_BIT|IR_OUT_BIT);
+                send_state = SENDER_IDLE;
+            }
+        }
+    }
+}
+
+// Number of frames that can still be queued with Send().
+static uint8_t SendQueueFree() {
+    return (queue_head - queue_tail - 1) & (SEND_QUEUE_LEN - 1);
 }
 
+// Queue a 32Bit value to be sent "copies" times.
+// "value" is the 32 bit value to send, typically just letters for easier
+// debugging :)
+// Returns false if the queue is full.
+bool Send(uint32_t value, uint8_t copies) {
+    const uint8_t tail = queue_tail;
+    if (((tail + 1) & (SEND_QUEUE_LEN - 1)) == queue_head)
+        return false;
+    QueuedFrame *f = &send_queue[tail];
+    f->bytes[0] = value >> 24;
+    f->bytes[1] = value >> 16;
+    f->bytes[2] = value >> 8;
+    f->bytes[3] = value;
+    f->copies = copies;
+    // Once the tail moves, the ISR might pick it up right away. If it went
+    // idle before, the timer is off and we start it.
+    queue_tail = (tail + 1) & (SEND_QUEUE_LEN - 1);
+    if (send_state != SENDER_IDLE)
+        return true;
+    BENCH_END(BENCH_WAKE_TO_BURST);
+    copies_left = copies - 1;
+    StartFrame();
+    OCR0A = CLOCK_COUNTER;
+    TCNT0 = 0;
+    TCCR0A = (1<<WGM01);   // OCRA compare. p.83
+#if IR_DUTY_PERCENT < 50
+    OCR0B = CLOCK_COUNTER_OFF;
+    TIMSK0 |= (1<<OCIE0A) | (1<<OCIE0B);  // Go
+#else
+    TIMSK0 |= (1<<OCIE0A);  // Go
+#endif
+    return true;
+}
+
+bool PollIsSendingDone() {
+    return send_state == SENDER_IDLE;
+}
+
+// The timer interrupt fires every CLOCK_COUNTER + 1 = 53 cycles at 4MHz.
+// Most ticks only switch the LED and count down, so with SEND_ISR_ASM that
+// is all the compare A handler does, in a few instructions that need no
+// register but r0. When the countdown runs out, it jumps to
+// __vector_send_phase, a regular interrupt handler that saves what
+// NextPhase() uses and returns from the interrupt itself.
+// Cycles, including the 4 cycle interrupt response and the rjmp in the
+// vector table: 24 for a burst tick that switches the LED on (on the pin
+// after IR_LED_ON_CYCLES), 22 for one that doesn't, 21 in a pause. Compare
+// B is 12 (IR_LED_OFF_CYCLES to the pin) and matches 40 cycles after A, so
+// they never wait for each other. Phase boundaries never switch the LED
+// on, so the longer path there can't stretch a pulse.
+#if SEND_ISR_ASM
+#if BENCH
+#  define ISR_BENCH_BEGIN "push r16\n\t"                              \
+                          "ldi r16, %[begin]\n\t"                     \
+                          "out %[gpior], r16\n\t"
+#  define ISR_BENCH_END   "ldi r16, %[end]\n\t"                       \
+                          "out %[gpior], r16\n\t"                     \
+                          "pop r16\n\t"
+#  define ISR_BENCH_LEAVE "pop r16\n\t"   // __vector_send_phase ends it.
+#else
+#  define ISR_BENCH_BEGIN
+#  define ISR_BENCH_END
+#  define ISR_BENCH_LEAVE
+#endif
+#if IR_DUTY_PERCENT < 50
+// On every other tick; TIM0_COMPB switches it off.
+#  define ISR_LED_ON "sbrs r12, 0\n\t"                               \
+                     "sbi %[port], %[pin]\n\t"
+#else
+#  define ISR_LED_ON "sbi %[pin_in], %[pin]\n\t"
+#endif
+ISR(TIM0_COMPA_vect, ISR_NAKED) {
+    asm volatile(
+        ISR_BENCH_BEGIN
+        "push r0\n\t"
+        "in r0, __SREG__\n\t"
+        "tst r13\n\t"              // send_state == BIT_BURST ?
+        "brne 1f\n\t"
+        ISR_LED_ON
+        "1: dec r12\n\t"           // --countdown == 0 ?
+        "breq 2f\n\t"
+        "out __SREG__, r0\n\t"
+        "pop r0\n\t"
+        ISR_BENCH_END
+        "reti\n"
+        "2: out __SREG__, r0\n\t"
+        "pop r0\n\t"
+        ISR_BENCH_LEAVE
+        "rjmp __vector_send_phase\n\t"
+        :: [port] "I" (_SFR_IO_ADDR(IR_OUT_PORT)),
+           [pin_in] "I" (_SFR_IO_ADDR(IR_OUT_PORT_IN)),
+           [pin] "I" (IR_OUT_PIN),
+           [gpior] "I" (_SFR_IO_ADDR(GPIOR0)),
+           [begin] "M" (BENCH_ISR), [end] "M" (BENCH_ISR | 0x80));
+}
+
+ISR(__vector_send_phase) {
+    NextPhase();
+    BENCH_END(BENCH_ISR);
+}
+
+#if IR_DUTY_PERCENT < 50
+ISR(TIM0_COMPB_vect, ISR_NAKED) {
+    asm volatile("cbi %[port], %[pin]\n\t"
+                 "reti\n\t"
+                 :: [port] "I" (_SFR_IO_ADDR(IR_OUT_PORT)),
+                    [pin] "I" (IR_OUT_PIN));
+}
+#endif
+#else
+// The same in C; also used by the host simulation (see sim/).
 ISR(TIM0_COMPA_vect) {
-    if (countdown == 0)
-        return;
+    BENCH_BEGIN(BENCH_ISR);
     if (send_state == BIT_BURST) {
+#if IR_DUTY_PERCENT < 50
+        if ((countdown & 1) == 0)
+            IR_OUT_PORT |= IR_OUT_BIT;  // TIM0_COMPB switches it off.
+#else
         IR_OUT_PORT ^= IR_OUT_BIT;
+#endif
     } // else we're in a pause-phase.
-    --countdown;
+    if (--countdown == 0)
+        NextPhase();
+    BENCH_END(BENCH_ISR);
+}
+
+#if IR_DUTY_PERCENT < 50
+ISR(TIM0_COMPB_vect) {
+    IR_OUT_PORT &= ~IR_OUT_BIT;
 }
+#endif
+#endif  // SEND_ISR_ASM
 
 // Pin change interrupt. Dummy in the interrupt vector to wake up.
 EMPTY_INTERRUPT(PCINT0_vect);
 EMPTY_INTERRUPT(PCINT1_vect);
 
+static volatile uint16_t button_ticks;
+ISR(WDT_vect) {
+    ++button_ticks;
+}
+
+static uint16_t GetButtonTicks() {
+    cli();
+    const uint16_t result = button_ticks;
+    sei();
+    return result;
+}
+
 static bool is_button_pressed() { return (BUT_PORT_IN & BUT_BIT) == 0; }
 static inline uint8_t rot_status() {
     const uint8_t rot_in = ROT_PORT_IN;
     return ((rot_in & ROT_B) ? 10 : 00) | ((rot_in & ROT_A) ? 01 : 00);
 }
 
+#if OSC_CALIBRATION
+// Knob and button, to notice any input while calibrating.
+static inline uint8_t input_status() {
+    return rot_status() | (is_button_pressed() ? 100 : 0);
+}
+
+// Waits for a watchdog tick. Returns false if the input changed
+// meanwhile.
+static bool WaitWatchdogTick(uint8_t input) {
+    const uint16_t tick = GetButtonTicks();
+    while (GetButtonTicks() == tick) {
+        if (input_status() != input)
+            return false;
+    }
+    return true;
+}
+
+// Timer1 counts in one watchdog period, synchronized by the watchdog
+// interrupt we have anyway for the button. Returns 0 on input.
+static uint16_t MeasureWatchdogPeriod(uint8_t input) {
+    if (!WaitWatchdogTick(input))
+        return 0;
+    const uint16_t start = TCNT1;
+    if (!WaitWatchdogTick(input))
+        return 0;
+    return TCNT1 - start;
+}
+
+// Step OSCCAL towards OSC_TARGET_COUNT; once we cross it, keep whichever
+// setting was closer. A step is less than 1%, so the drift since the last
+// calibration is typically fixed in one or two.
+// This takes up to two watchdog periods (16ms each) per step, so we only
+// do it when idle; any input aborts it, keeping the steps made so far, and
+// we return false.
+static bool CalibrateOscillator() {
+    const uint8_t input = input_status();
+    bool done = true;
+    PRR &= ~(1<<PRTIM1);
+    TCCR1A = 0;
+    TCCR1B = (1<<CS11);   // clk/8
+    WDTCSR = (1<<WDIE);
+    int16_t last_error = 0;
+    int8_t step = 0;
+    for (uint8_t i = 0; i < OSC_CALIBRATION_STEPS; ++i) {
+        const uint16_t count = MeasureWatchdogPeriod(input);
+        if (count == 0) {
+            done = false;
+            break;
+        }
+        const int16_t error = count - OSC_TARGET_COUNT;
+        if (error == 0)
+            break;
+        if (step != 0 && (error < 0) != (last_error < 0)) {
+            const int16_t abs_error = error < 0 ? -error : error;
+            const int16_t abs_last = last_error < 0 ? -last_error : last_error;
+            if (abs_error > abs_last)
+                OSCCAL -= step;
+            break;
+        }
+        step = (error > 0) ? -1 : 1;   // Too many counts: too fast.
+        OSCCAL += step;
+        last_error = error;
+    }
+    TCCR1B = 0;
+    WDTCSR = 0;
+    PRR |= (1<<PRTIM1);
+    return done;
+}
+#endif
+
 int main() {
     clock_prescale_set(clock_div_2);   // Default speed: 4Mhz
     send_state = SENDER_IDLE;
@@ -177,41 +563,127 @@ int main() {
 
     TCCR0B = (1<<CS00);     // timer 0: no prescaling p.84
 
-    PRR = (1<<PRADC);  // Don't need ADC. Power down.
+    PRR = (1<<PRADC)|(1<<PRTIM1);  // Don't need ADC and Timer1. Power down.
 
     sei();
 
+#if OSC_CALIBRATION
+    CalibrateOscillator();
+    uint8_t frames_since_calibration = 0;
+#endif
+
+    uint8_t device_id = eeprom_read_byte(&ee_device_id);
+    if (device_id == 0xff)
+        device_id = DEVICE_ID;
+
     QuadDecoder rotary;
     int rot_pos = 0;
-    bool last_button_status = false;
+    uint8_t sequence = 0;
+    uint8_t preset_command = 0;   // While pressed: what turning means.
+    DebouncedButton button(MS_TO_BUTTON_TICKS(BUTTON_DEBOUNCE_MS),
+                           MS_TO_BUTTON_TICKS(BUTTON_LONG_PRESS_MS),
+                           MS_TO_BUTTON_TICKS(BUTTON_DOUBLE_PRESS_MS));
 
     for (;;) {
+        BENCH_BEGIN(BENCH_MAIN_LOOP);
         // We accumulate the state here, so that we can send it possibly slower
         // than they are generated.
-        rot_pos += rotary.UpdateEnoderState(rot_status());
-        const bool new_button_status = is_button_pressed();
-        // If sender status is free, send our status.
-        if (PollIsSendingDone()) {
-            if (rot_pos > 0) {
-                Send(COMMAND_MORE);
+        const int8_t rot_diff = rotary.UpdateEnoderState(rot_status());
+        if (rot_diff != 0)
+            LATENCY_PULSE();
+        rot_pos += rot_diff;
+        // If there is room in the send queue, send our status. Otherwise
+        // rotation keeps accumulating.
+        if (SendQueueFree() > 0) {
+            uint8_t command = 0;
+            uint8_t arg = 0;
+            if (rot_pos > 0 && !preset_command) {
+                command = COMMAND_MORE;
                 rot_pos = 0;
             }
-            else if (rot_pos < 0) {
-                Send(COMMAND_LESS);
+            else if (rot_pos < 0 && !preset_command) {
+                command = COMMAND_LESS;
                 rot_pos = 0;
             }
             else {
-                if (!last_button_status && new_button_status) Send(COMMAND_B_ON);
-                if (last_button_status && !new_button_status) Send(COMMAND_BOFF);
-                //if (last_button_status && new_button_status)  Send(COMMAND_BHLD);
-                last_button_status = new_button_status;
+                // While pressed, the knob counts the preset slot.
+                switch (button.Update(is_button_pressed(), GetButtonTicks())) {
+                case DebouncedButton::PRESS:
+                    preset_command = COMMAND_PGET;
+                    break;
+                case DebouncedButton::RELEASE:
+                    if (preset_command && rot_pos != 0) {
+                        const int detents = rot_pos < 0 ? -rot_pos : rot_pos;
+                        command = preset_command;
+                        arg = (detents < PRESET_SLOTS ? detents : PRESET_SLOTS) - 1;
+                    }
+                    else if (preset_command == COMMAND_PSET) {
+                        command = COMMAND_BOFF;  // End of a long press.
+                    }
+                    else {
+                        command = COMMAND_B_ON;  // A click.
+                    }
+                    preset_command = 0;
+                    rot_pos = 0;
+                    break;
+                case DebouncedButton::LONG_PRESS:
+                    command = COMMAND_BHLD;
+                    if (rot_pos == 0)  // Else already turned for a recall.
+                        preset_command = COMMAND_PSET;
+                    break;
+                case DebouncedButton::DOUBLE_PRESS:
+                    // Pairs; its release is a click again, so mute ends up
+                    // where it was.
+                    command = COMMAND_BDBL;
+                    preset_command = COMMAND_PGET;
+                    break;
+                case DebouncedButton::NONE: break;
+                }
+            }
+            if (command) {
+                sequence = (sequence + 1) & 0x0f;
+                Send(MK_FRAME(device_id, command, arg, sequence),
+                     IR_FRAME_REPEATS);
+#if OSC_CALIBRATION
+                ++frames_since_calibration;
+#endif
             }
         }
 
+        BENCH_END(BENCH_MAIN_LOOP);
+
+        // Nothing to do until the next timer tick; idle instead of
+        // spinning. The ISR stops the timer when it is done, so check
+        // with interrupts off; sleep_cpu() right after sei() still runs
+        // before a pending interrupt.
+        cli();
+        if (!PollIsSendingDone()) {
+            set_sleep_mode(SLEEP_MODE_IDLE);
+            sleep_enable();
+            sei();
+            sleep_cpu();
+            sleep_disable();
+        }
+        sei();
+
+#if OSC_CALIBRATION
+        // Only when we'd sleep until the next input anyway: nothing to
+        // send, knob at rest and the button not timing anything. If the
+        // user starts turning meanwhile, look at that first.
+        if (PollIsSendingDone() && rot_pos == 0 && !button.busy()
+            && frames_since_calibration >= OSC_CALIBRATION_FRAMES) {
+            if (CalibrateOscillator())
+                frames_since_calibration = 0;
+            continue;
+        }
+#endif
+
 #if SLEEP_AFTER_TRANSMIT
         if (PollIsSendingDone()) {
             cli();
             GIMSK |= (1<<PCIE0)|(1<<PCIE1);          // level change interrupt
+            // The button needs a clock while it is timing something.
+            WDTCSR = button.busy() ? (1<<WDIE) : 0;
             set_sleep_mode(SLEEP_MODE_PWR_DOWN);
 
             sleep_enable();
@@ -221,6 +693,7 @@ int main() {
             // Zzzz...
 
             // Waking up due to interrupt.
+            BENCH_BEGIN(BENCH_WAKE_TO_BURST);
             sleep_disable();
             GIMSK = 0;
         }
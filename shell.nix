@@ -17,5 +17,7 @@ pkgs.mkShell {
       # Firmware
       pkgsCross.avr.buildPackages.gcc9
       avrdude
+      simavr  # make bench
+      libelf
     ];
 }
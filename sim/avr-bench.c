@@ -0,0 +1,260 @@
+/* -*- mode: c; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * Copyright (c) h.zeller@acm.org. GNU public License.
+ *
+ * Runs a firmware image built with -DBENCH=1 in simavr, feeds it pin stimuli
+ * and reports the cycles spent between the BENCH_BEGIN()/BENCH_END() markers
+ * (see sender/bench.h, receiver/bench.h).
+ *
+ * Stimulus files have one event per line: <time-ms> <what> <value>
+ *   12.5 D3 0        set input pin PD3 low
+ *   0    0x2c 0x04   poke value into data memory address (e.g. PINA on a
+ *                    simulated ATtiny48)
+ * Lines starting with # are ignored. Events from several files are merged.
+ *
+ * An acknowledging DS1882 is attached to the TWI bus.
+ */
+
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sim_avr.h"
+#include "sim_elf.h"
+#include "sim_io.h"
+#include "avr_ioport.h"
+#include "avr_twi.h"
+
+#define MAX_MARKERS 16
+#define MAX_EVENTS  100000
+
+static const char *const kMarkerNames[MAX_MARKERS] = {
+  [1] = "isr",
+  [2] = "main-loop",
+  [3] = "ir-decode",
+  [4] = "pot-update",
+  [5] = "eeprom-flush",
+  [6] = "wake-to-burst",
+  [7] = "boot-to-ready",
+};
+
+struct Marker {
+  avr_cycle_count_t begin;  // 0: not started.
+  unsigned long count;
+  avr_cycle_count_t min, max, sum;
+};
+static struct Marker markers[MAX_MARKERS];
+
+struct Event {
+  avr_cycle_count_t cycle;
+  char port;          // 0 for memory poke.
+  int bit_or_addr;
+  int value;
+};
+static struct Event events[MAX_EVENTS];
+static int event_count = 0;
+
+static void marker_write(struct avr_t *avr, avr_io_addr_t addr, uint8_t v,
+                         void *param) {
+  struct Marker *m = &markers[v & (MAX_MARKERS - 1)];
+  if ((v & 0x80) == 0) {
+    m->begin = avr->cycle;
+    return;
+  }
+  if (m->begin == 0)
+    return;   // Start not seen.
+  const avr_cycle_count_t duration = avr->cycle - m->begin;
+  if (m->count == 0 || duration < m->min) m->min = duration;
+  if (duration > m->max) m->max = duration;
+  m->sum += duration;
+  m->count++;
+  m->begin = 0;
+}
+
+// A DS1882: acknowledges its address and remembers the wipers so that
+// they can be read back.
+struct DS1882 {
+  avr_irq_t *input;
+  uint8_t address;     // 8 bit address, write.
+  uint8_t selected;
+  uint8_t reg[3];      // wiper 0, wiper 1, config
+  int read_pos;
+};
+
+static void twi_hook(struct avr_irq_t *irq, uint32_t value, void *param) {
+  struct DS1882 *pot = (struct DS1882 *) param;
+  avr_twi_msg_irq_t v;
+  v.u.v = value;
+  if (v.u.twi.msg & TWI_COND_STOP)
+    pot->selected = 0;
+  if (v.u.twi.msg & TWI_COND_START) {
+    pot->selected = 0;
+    pot->read_pos = 0;
+    if ((v.u.twi.addr & 0xfe) == pot->address) {
+      pot->selected = v.u.twi.addr;
+      avr_raise_irq(pot->input,
+                    avr_twi_irq_msg(TWI_COND_ACK, pot->selected, 1));
+    }
+  }
+  if (!pot->selected)
+    return;
+  if (v.u.twi.msg & TWI_COND_WRITE) {
+    avr_raise_irq(pot->input, avr_twi_irq_msg(TWI_COND_ACK, pot->selected, 1));
+    const uint8_t data = v.u.twi.data;
+    pot->reg[data >> 6 < 3 ? data >> 6 : 2] = data;
+  }
+  if (v.u.twi.msg & TWI_COND_READ) {
+    avr_raise_irq(pot->input, avr_twi_irq_msg(TWI_COND_READ, pot->selected,
+                                              pot->reg[pot->read_pos]));
+    pot->read_pos = (pot->read_pos + 1) % 3;
+  }
+}
+
+static int compare_events(const void *a, const void *b) {
+  const struct Event *ea = (const struct Event *) a;
+  const struct Event *eb = (const struct Event *) b;
+  return (ea->cycle > eb->cycle) - (ea->cycle < eb->cycle);
+}
+
+static int read_stimulus(const char *filename, uint32_t frequency) {
+  FILE *f = fopen(filename, "r");
+  if (!f) {
+    perror(filename);
+    return 0;
+  }
+  char line[256];
+  int lineno = 0;
+  while (fgets(line, sizeof(line), f)) {
+    ++lineno;
+    double ms;
+    char what[32];
+    int value;
+    if (line[0] == '#' || line[0] == '\n')
+      continue;
+    if (sscanf(line, "%lf %31s %i", &ms, what, &value) != 3
+        || event_count >= MAX_EVENTS) {
+      fprintf(stderr, "%s:%d: can't parse\n", filename, lineno);
+      fclose(f);
+      return 0;
+    }
+    struct Event *e = &events[event_count++];
+    e->cycle = (avr_cycle_count_t)(ms * frequency / 1000);
+    e->value = value;
+    if (what[0] >= 'A' && what[0] <= 'F' && what[1] >= '0' && what[1] <= '7') {
+      e->port = what[0];
+      e->bit_or_addr = what[1] - '0';
+    } else {
+      e->port = 0;
+      e->bit_or_addr = strtol(what, NULL, 0);
+    }
+  }
+  fclose(f);
+  return 1;
+}
+
+static void apply_event(avr_t *avr, const struct Event *e) {
+  if (e->port) {
+    avr_raise_irq(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ(e->port),
+                                e->bit_or_addr), e->value);
+  } else {
+    avr->data[e->bit_or_addr] = e->value;
+  }
+}
+
+static int usage(const char *progname) {
+  fprintf(stderr, "usage: %s [options] <firmware.elf>\n"
+          "Options:\n"
+          "\t-m <mcu>       : simavr core name, e.g. attiny44.\n"
+          "\t-f <hz>        : CPU frequency.\n"
+          "\t-g <addr>      : Data address of the marker register GPIOR0.\n"
+          "\t-s <file>      : Stimulus file. Can be given multiple times.\n"
+          "\t-t <ms>        : Simulated time to run.\n",
+          progname);
+  return 1;
+}
+
+int main(int argc, char *argv[]) {
+  const char *mcu = NULL;
+  uint32_t frequency = 8000000;
+  int marker_addr = -1;
+  double run_ms = 1000;
+  const char *stimulus_files[8];
+  int stimulus_count = 0;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "m:f:g:s:t:")) != -1) {
+    switch (opt) {
+    case 'm': mcu = optarg; break;
+    case 'f': frequency = strtoul(optarg, NULL, 0); break;
+    case 'g': marker_addr = strtol(optarg, NULL, 0); break;
+    case 't': run_ms = atof(optarg); break;
+    case 's':
+      if (stimulus_count < 8) stimulus_files[stimulus_count++] = optarg;
+      break;
+    default:
+      return usage(argv[0]);
+    }
+  }
+  if (optind >= argc || mcu == NULL || marker_addr < 0)
+    return usage(argv[0]);
+
+  elf_firmware_t firmware;
+  memset(&firmware, 0, sizeof(firmware));
+  if (elf_read_firmware(argv[optind], &firmware) != 0) {
+    fprintf(stderr, "Can't read %s\n", argv[optind]);
+    return 1;
+  }
+  avr_t *avr = avr_make_mcu_by_name(mcu);
+  if (!avr) {
+    fprintf(stderr, "simavr doesn't know MCU '%s'\n", mcu);
+    return 1;
+  }
+  avr_init(avr);
+  avr->frequency = frequency;
+  avr_load_firmware(avr, &firmware);
+
+  for (int i = 0; i < stimulus_count; ++i) {
+    if (!read_stimulus(stimulus_files[i], frequency))
+      return 1;
+  }
+  qsort(events, event_count, sizeof(events[0]), compare_events);
+
+  avr_register_io_write(avr, marker_addr, marker_write, NULL);
+
+  static struct DS1882 pot;
+  pot.address = 0x50;
+  pot.input = avr_io_getirq(avr, AVR_IOCTL_TWI_GETIRQ(0), TWI_IRQ_INPUT);
+  avr_irq_t *twi_out = avr_io_getirq(avr, AVR_IOCTL_TWI_GETIRQ(0),
+                                     TWI_IRQ_OUTPUT);
+  if (twi_out)
+    avr_irq_register_notify(twi_out, twi_hook, &pot);
+
+  const avr_cycle_count_t end_cycle =
+    (avr_cycle_count_t)(run_ms * frequency / 1000);
+  int next_event = 0;
+  int state = cpu_Running;
+  while (avr->cycle < end_cycle
+         && state != cpu_Done && state != cpu_Crashed) {
+    while (next_event < event_count && events[next_event].cycle <= avr->cycle)
+      apply_event(avr, &events[next_event++]);
+    state = avr_run(avr);
+  }
+  if (state == cpu_Crashed) {
+    fprintf(stderr, "CPU crashed at %.3fms\n", 1000.0 * avr->cycle / frequency);
+    return 1;
+  }
+
+  printf("# %s @%uHz, %.0fms simulated; values in CPU cycles.\n",
+         mcu, frequency, run_ms);
+  for (int i = 0; i < MAX_MARKERS; ++i) {
+    const struct Marker *m = &markers[i];
+    if (m->count == 0) continue;
+    const char *name = kMarkerNames[i] ? kMarkerNames[i] : "unknown";
+    printf("%s.count %lu\n", name, m->count);
+    printf("%s.min %llu\n", name, (unsigned long long) m->min);
+    printf("%s.avg %llu\n", name, (unsigned long long) (m->sum / m->count));
+    printf("%s.max %llu\n", name, (unsigned long long) m->max);
+  }
+  return 0;
+}
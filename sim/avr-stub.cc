@@ -0,0 +1,9 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * Copyright (c) h.zeller@acm.org. GNU public License.
+ */
+#include <avr/io.h>
+
+#define SIM_DEFINE_REGISTER(r) volatile uint8_t r;
+SIM_REGISTERS(SIM_DEFINE_REGISTER)
+#undef SIM_DEFINE_REGISTER
+volatile uint16_t TCNT1;
@@ -0,0 +1,25 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * Copyright (c) h.zeller@acm.org. GNU public License.
+ *
+ * EEPROM variables are plain variables on the host, initialized with what
+ * 'make eeprom-flash' would write.
+ */
+#ifndef SIM_AVR_EEPROM_H_
+#define SIM_AVR_EEPROM_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#define EEMEM
+
+static inline uint8_t eeprom_read_byte(const uint8_t *p) { return *p; }
+static inline void eeprom_write_byte(uint8_t *p, uint8_t v) { *p = v; }
+static inline void eeprom_update_byte(uint8_t *p, uint8_t v) { *p = v; }
+static inline void eeprom_read_block(void *dst, const void *src, size_t n) {
+  memcpy(dst, src, n);
+}
+static inline void eeprom_update_block(const void *src, void *dst, size_t n) {
+  memcpy(dst, src, n);
+}
+
+#endif  // SIM_AVR_EEPROM_H_
@@ -0,0 +1,15 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * Copyright (c) h.zeller@acm.org. GNU public License.
+ *
+ * Interrupt vectors become plain functions the simulation calls directly.
+ */
+#ifndef SIM_AVR_INTERRUPT_H_
+#define SIM_AVR_INTERRUPT_H_
+
+#define ISR(vector) extern "C" void vector(void); void vector(void)
+#define EMPTY_INTERRUPT(vector) extern "C" void vector(void) {}
+
+static inline void sei() {}
+static inline void cli() {}
+
+#endif  // SIM_AVR_INTERRUPT_H_
@@ -0,0 +1,39 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * Copyright (c) h.zeller@acm.org. GNU public License.
+ *
+ * Just enough of <avr/io.h> for the attiny44 sender to compile on the host.
+ * The registers are plain variables defined in avr-stub.cc.
+ */
+#ifndef SIM_AVR_IO_H_
+#define SIM_AVR_IO_H_
+
+#include <stdint.h>
+
+#define SIM_REGISTERS(X)                                                \
+  X(PORTA) X(DDRA) X(PINA) X(PORTB) X(DDRB) X(PINB)                     \
+  X(OCR0A) X(OCR0B) X(TCNT0) X(TCCR0A) X(TCCR0B) X(TIMSK0)              \
+  X(GIMSK) X(PCMSK0) X(PCMSK1) X(PRR) X(GPIOR0) X(WDTCSR)             \
+  X(TCCR1A) X(TCCR1B) X(OSCCAL)
+
+#define SIM_DECLARE_REGISTER(r) extern volatile uint8_t r;
+SIM_REGISTERS(SIM_DECLARE_REGISTER)
+#undef SIM_DECLARE_REGISTER
+extern volatile uint16_t TCNT1;
+
+#define OCIE0A  1
+#define OCIE0B  2
+#define WGM00   0
+#define WGM01   1
+#define CS00    0
+#define CS01    1
+#define CS11    1
+#define PCIE0   4
+#define PCIE1   5
+#define PCINT3  3
+#define PCINT7  7
+#define PCINT8  0
+#define PRADC   0
+#define PRTIM1  3
+#define WDIE    6
+
+#endif  // SIM_AVR_IO_H_
@@ -0,0 +1,10 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * Copyright (c) h.zeller@acm.org. GNU public License.
+ */
+#ifndef SIM_AVR_POWER_H_
+#define SIM_AVR_POWER_H_
+
+enum { clock_div_1, clock_div_2 };
+static inline void clock_prescale_set(int) {}
+
+#endif  // SIM_AVR_POWER_H_
@@ -0,0 +1,16 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * Copyright (c) h.zeller@acm.org. GNU public License.
+ */
+#ifndef SIM_AVR_SLEEP_H_
+#define SIM_AVR_SLEEP_H_
+
+#define SLEEP_MODE_IDLE     0
+#define SLEEP_MODE_PWR_DOWN 2
+
+static inline void set_sleep_mode(int) {}
+static inline void sleep_enable() {}
+static inline void sleep_disable() {}
+static inline void sleep_cpu() {}
+static inline void sleep_mode() {}
+
+#endif  // SIM_AVR_SLEEP_H_
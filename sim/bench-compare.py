@@ -0,0 +1,64 @@
+#!/usr/bin/env python3
+# <h.zeller@acm.org>
+##
+# Compare the output of 'make bench' with a checked-in baseline.
+# Both files have lines "<name> <value>"; '#' starts a comment.
+# Exits non-zero if any value got worse by more than the tolerance, if a
+# value is only in one of the files (a marker that is not reached anymore,
+# or one that has no baseline yet), or if there is no baseline at all.
+#
+# Counts (*.count) are informational only: they depend on the stimulus.
+
+import sys
+
+def read_values(filename):
+    result = {}
+    with open(filename) as f:
+        for line in f:
+            line = line.split('#', 1)[0].split()
+            if len(line) == 2:
+                result[line[0]] = int(line[1])
+    return result
+
+def main(argv):
+    if len(argv) < 3:
+        sys.stderr.write("usage: %s <baseline> <current> [tolerance-percent]\n"
+                         % argv[0])
+        return 2
+    try:
+        baseline = read_values(argv[1])
+    except IOError as e:
+        sys.stderr.write("Can't read baseline: %s\n" % e)
+        return 2
+    if not baseline:
+        sys.stderr.write("%s has no values; create it with "
+                         "'make bench-baseline'\n" % argv[1])
+        return 2
+    current = read_values(argv[2])
+    tolerance = float(argv[3]) if len(argv) > 3 else 2.0
+    regressions = 0
+    print("%-24s %10s %10s %8s" % ("", "baseline", "current", "change"))
+    for name in sorted(set(baseline) | set(current)):
+        before, now = baseline.get(name), current.get(name)
+        if before is None or now is None:
+            print("%-24s %10s %10s %8s" % (name, before if before is not None
+                                           else "-", now if now is not None
+                                           else "-", "new" if before is None
+                                           else "gone"))
+            regressions += 1
+            continue
+        change = 100.0 * (now - before) / before if before else 0.0
+        flag = ""
+        if not name.endswith(".count") and change > tolerance:
+            flag = "  <-- REGRESSION"
+            regressions += 1
+        print("%-24s %10d %10d %+7.1f%%%s" % (name, before, now, change, flag))
+    if regressions:
+        print("%d regression(s) beyond %.1f%% or missing values. If intended, "
+              "update the baseline with 'make bench-baseline'"
+              % (regressions, tolerance))
+        return 1
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
@@ -0,0 +1,230 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * Copyright (c) h.zeller@acm.org. GNU public License.
+ *
+ * Worst case execution time fuzzing of the receiver IR decoder.
+ *
+ * The input is interpreted as a sequence of phase durations on the IR pin
+ * starting with a low phase, as this is how the decoder is entered:
+ *   byte 0      : bit 0 set: the line stays low after the last phase.
+ *   bytes 1,2.. : little-endian 16 bit durations in microseconds.
+ * Each call of decode_infrared() is timed in simulated receiver time; a call
+ * exceeding the budget aborts, one that doesn't return at all is a hang.
+ *
+ * Built either as a libFuzzer target (make ir-fuzz-libfuzzer, needs clang)
+ * or with a standalone driver that runs generated inputs and files given on
+ * the command line (make ir-fuzz).
+ */
+
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <random>
+#include <vector>
+
+#include "sim-pin.h"
+#include "../receiver/ir-decoder.h"
+
+#define RECEIVER_F_CPU  8000000.0
+
+// Decoder loop iterations take about this many cycles. The loops waiting
+// for the low phase to end are a bit cheaper, so this overestimates.
+#ifndef RX_CYCLES_PER_LOOP
+#  define RX_CYCLES_PER_LOOP 9
+#endif
+
+// The guarantee we want: no input keeps the decoder busy longer. A bit
+// more than IR_FRAME_TIMEOUT, the longest frame we accept.
+#ifndef IR_WCET_BUDGET_MS
+#  define IR_WCET_BUDGET_MS 75
+#endif
+
+namespace {
+struct Hang {};
+
+double deadline;
+
+bool fuzz_infrared_in() {
+  if (SimPin::now > deadline) throw Hang();
+  return sim_infrared_in();
+}
+
+// Run the decoder over the input. Returns the time spent in seconds or
+// a negative value if it didn't return within 10x the budget.
+double RunDecoder(const uint8_t *data, size_t size) {
+  static std::vector<LowPhase> phases;
+  phases.clear();
+  if (size < 1) return 0;
+  const bool stuck_low = data[0] & 1;
+  double t = 0;
+  bool low = true;
+  for (size_t i = 1; i + 1 < size; i += 2) {
+    const double duration = (data[i] | data[i+1] << 8) * 1e-6;
+    if (low) {
+      LowPhase p = { t, t + duration };
+      phases.push_back(p);
+    }
+    t += duration;
+    low = !low;
+  }
+  if (stuck_low) {
+    LowPhase p = { low ? t : t + 1e-6, 1e9 };
+    phases.push_back(p);
+  }
+  MergeLowPhases(&phases);
+
+  SimPin::Reset(&phases, RX_CYCLES_PER_LOOP / RECEIVER_F_CPU);
+  deadline = 10 * IR_WCET_BUDGET_MS * 1e-3;
+  uint8_t buffer[4];
+  try {
+    decode_infrared<fuzz_infrared_in>(buffer, 0);
+  }
+  catch (Hang &) {
+    return -1;
+  }
+  return SimPin::now;
+}
+}  // namespace
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  const double t = RunDecoder(data, size);
+  if (t < 0 || t > IR_WCET_BUDGET_MS * 1e-3) {
+    fprintf(stderr, "decoder busy %s%.1fms; budget is %dms\n",
+            t < 0 ? "> " : "", t < 0 ? 10e3 * IR_WCET_BUDGET_MS : 1e3 * t,
+            IR_WCET_BUDGET_MS);
+    abort();
+  }
+  return 0;
+}
+
+#ifndef USE_LIBFUZZER
+// Phase lengths (us) an adversary would pick: glitches, values around the
+// thresholds and just below the timeouts.
+static uint16_t InterestingDuration(std::mt19937 *rnd) {
+  const double us_per_count = 1e6 * RX_CYCLES_PER_LOOP / RECEIVER_F_CPU;
+  const uint16_t interesting[] = {
+    1, 5, 20, 200, 400, 1400, 2300, 3300, 65535,
+    (uint16_t)(IR_LO_HI_BIT_THRESHOLD * us_per_count),
+    (uint16_t)(IR_LOW_TIMEOUT * us_per_count - 2),
+    (uint16_t)(IR_HEADER_TIMEOUT * us_per_count - 2),
+    (uint16_t)(IR_END_OF_SIGNAL * us_per_count - 2),
+  };
+  const int n = sizeof(interesting) / sizeof(interesting[0]);
+  std::uniform_int_distribution<int> pick(0, 2 * n);
+  const int i = pick(*rnd);
+  if (i < n) return interesting[i];
+  return std::uniform_int_distribution<int>(1, 12000)(*rnd);
+}
+
+struct Stats {
+  unsigned long runs;
+  unsigned long hangs;
+  unsigned long over_budget;
+  double max_time;
+  std::vector<uint8_t> worst_input;
+};
+
+static void Run(const std::vector<uint8_t> &input, Stats *stats) {
+  const double t = RunDecoder(input.data(), input.size());
+  stats->runs++;
+  if (t < 0) {
+    stats->hangs++;
+  } else if (t > IR_WCET_BUDGET_MS * 1e-3) {
+    stats->over_budget++;
+  }
+  if (t < 0 || (t > stats->max_time && stats->max_time >= 0)) {
+    stats->max_time = t;
+    stats->worst_input = input;
+  }
+}
+
+static bool ReadFile(const char *filename, std::vector<uint8_t> *out) {
+  FILE *f = fopen(filename, "rb");
+  if (!f) {
+    perror(filename);
+    return false;
+  }
+  uint8_t buf[4096];
+  size_t r;
+  out->clear();
+  while ((r = fread(buf, 1, sizeof(buf), f)) > 0)
+    out->insert(out->end(), buf, buf + r);
+  fclose(f);
+  return true;
+}
+
+static int usage(const char *progname) {
+  fprintf(stderr, "usage: %s [options] [input-file...]\n"
+          "Options:\n"
+          "\t-n <count> : Number of generated inputs (default 200000).\n"
+          "\t-s <seed>  : Random seed.\n", progname);
+  return 1;
+}
+
+int main(int argc, char *argv[]) {
+  unsigned long iterations = 200000;
+  unsigned int seed = 1;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:s:h")) != -1) {
+    switch (opt) {
+    case 'n': iterations = strtoul(optarg, NULL, 0); break;
+    case 's': seed = atoi(optarg); break;
+    default: return usage(argv[0]);
+    }
+  }
+
+  Stats stats;
+  stats.runs = stats.hangs = stats.over_budget = 0;
+  stats.max_time = 0;
+  std::vector<uint8_t> input;
+
+  for (int i = optind; i < argc; ++i) {
+    if (!ReadFile(argv[i], &input)) return 1;
+    Run(input, &stats);
+  }
+
+  // Worst case by construction: every phase just below its timeout.
+  input.assign(1, 0);
+  for (int i = 0; i < 70; ++i) {
+    const double us_per_count = 1e6 * RX_CYCLES_PER_LOOP / RECEIVER_F_CPU;
+    const int timeout = (i == 0 ? IR_HEADER_TIMEOUT
+                         : i % 2 == 0 ? IR_LOW_TIMEOUT : IR_END_OF_SIGNAL);
+    const uint16_t d = timeout * us_per_count - 2;
+    input.push_back(d & 0xff);
+    input.push_back(d >> 8);
+  }
+  Run(input, &stats);
+  input.assign(1, 1);  // Stuck low.
+  Run(input, &stats);
+
+  std::mt19937 rnd(seed);
+  std::uniform_int_distribution<int> phase_count(0, 80);
+  std::uniform_int_distribution<int> flag(0, 1);
+  for (unsigned long i = 0; i < iterations; ++i) {
+    input.assign(1, flag(rnd));
+    for (int p = phase_count(rnd); p > 0; --p) {
+      const uint16_t d = InterestingDuration(&rnd);
+      input.push_back(d & 0xff);
+      input.push_back(d >> 8);
+    }
+    Run(input, &stats);
+  }
+
+  printf("runs: %lu  hangs: %lu  over budget: %lu\n",
+         stats.runs, stats.hangs, stats.over_budget);
+  if (stats.max_time < 0)
+    printf("max time per call: hang\n");
+  else
+    printf("max time per call: %.2fms\n", 1e3 * stats.max_time);
+  printf("budget: %dms; analytic bound: %.1fms\n", IR_WCET_BUDGET_MS,
+         1e3 * (IR_FRAME_TIMEOUT + IR_MIN_PULSE)
+         * RX_CYCLES_PER_LOOP / RECEIVER_F_CPU);
+  printf("worst input (%d bytes):", (int)stats.worst_input.size());
+  for (size_t i = 0; i < stats.worst_input.size() && i < 32; ++i)
+    printf(" %02x", stats.worst_input[i]);
+  printf("%s\n", stats.worst_input.size() > 32 ? " ..." : "");
+  return (stats.hangs || stats.over_budget) ? 1 : 0;
+}
+#endif  // USE_LIBFUZZER
@@ -0,0 +1,519 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * Copyright (c) h.zeller@acm.org. GNU public License.
+ *
+ * Host-side simulation of the infrared link: runs the real sender state
+ * machine from sender/transmitter.cc, models the IR LED, the TSOP75338 and a
+ * noisy channel and feeds the result into the real receiver decoder.
+ *
+ * Reports frame error rate and decode latency, optionally sweeping one
+ * channel parameter.
+ */
+
+#include <getopt.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <random>
+#include <vector>
+
+#include <avr/io.h>   // The stub registers the sender writes.
+
+#include "sim-pin.h"
+#include "../receiver/ir-decoder.h"
+
+// From sender/transmitter.cc
+extern "C" void TIM0_COMPA_vect(void);
+extern "C" void TIM0_COMPB_vect(void) __attribute__((weak));
+bool Send(uint32_t value, uint8_t copies);
+bool PollIsSendingDone();
+extern const uint8_t kFrameRepeats;
+
+#define SENDER_F_CPU    4000000.0
+#define RECEIVER_F_CPU  8000000.0
+#define SENDER_IR_OUT_BIT (1<<0)
+
+// Frames as in sender/transmitter.cc: [device id][command][argument][seq]
+#define MK_COMMAND(a, b, c, d) \
+  ((uint32_t)a << 24 | (uint32_t)b << 16 | (uint32_t)c << 8 | d)
+#define DEVICE_ID         0x01
+#define FOREIGN_DEVICE_ID 0x02
+static const uint32_t kCommands[] = {
+  MK_COMMAND(DEVICE_ID, 'm', 0, 0),
+  MK_COMMAND(DEVICE_ID, 'l', 0, 0),
+  MK_COMMAND(DEVICE_ID, 'p', 0, 0),
+  MK_COMMAND(DEVICE_ID, 'g', 3, 0),  // Preset recall; slot in the argument.
+};
+static const int kNumCommands = sizeof(kCommands) / sizeof(kCommands[0]);
+
+// The last byte: sequence number and a check nibble that makes the XOR of
+// all nibbles zero.
+static uint32_t AddSequence(uint32_t code, uint8_t seq) {
+  seq &= 0x0f;
+  const uint8_t x = (code >> 24) ^ (code >> 16) ^ (code >> 8);
+  return (code & 0xffffff00) | seq << 4 | ((x ^ (x >> 4) ^ seq) & 0x0f);
+}
+static bool FrameCheckOk(const uint8_t *frame) {
+  const uint8_t x = frame[0] ^ frame[1] ^ frame[2] ^ frame[3];
+  return ((x ^ (x >> 4)) & 0x0f) == 0;
+}
+
+static bool AcceptOurDevice(uint8_t id) { return id == DEVICE_ID; }
+
+struct Params {
+  double start_ms;        // Time of the first frame.
+  double frames;          // Number of frames to send.
+  double gap_ms;          // Idle time between frames; 0: back-to-back.
+  double tx_clock;        // Sender RC oscillator; actual/nominal.
+  double repeats;         // Transmissions per frame.
+  double rx_clock;        // Receiver RC oscillator; actual/nominal.
+  double rx_cycles;       // Receiver CPU cycles per decoder loop iteration.
+  double rx_loop_us;      // Receiver main loop pass outside the decoder.
+  double tsop_on;         // TSOP envelope delays in carrier cycles.
+  double tsop_off;
+  double tsop_min_burst;  // Shorter bursts (carrier cycles) are not seen.
+  double jitter_us;       // Gaussian sigma applied to every TSOP edge.
+  double drop;            // Probability that a burst is missed.
+  double glitch_rate;     // Ambient light glitches per second.
+  double glitch_us;       // Maximum width of a glitch.
+  double foreign;         // Fraction of frames from another device.
+  double rx_filter;       // Reject foreign frames after the first byte.
+  double rx_skip_ms;      // ... and then ignore IR for this long.
+  double vcc;             // Energy estimate of the sender.
+  double led_ma;          // IR LED current while on.
+  double cpu_ma;          // CPU active current.
+  double idle_ma;         // CPU current in SLEEP_MODE_IDLE.
+  double tx_awake;        // CPU cycles awake per ISR tick while sending.
+};
+
+static const struct {
+  const char *name;
+  double Params::*field;
+  const char *description;
+} kParamNames[] = {
+  { "start",      &Params::start_ms,       "ms before the first frame" },
+  { "frames",     &Params::frames,         "Number of frames to send" },
+  { "gap",        &Params::gap_ms,         "ms idle between frames. 0: back-to-back" },
+  { "tx-clock",   &Params::tx_clock,       "Sender oscillator actual/nominal" },
+  { "repeats",    &Params::repeats,        "Transmissions of each frame" },
+  { "rx-clock",   &Params::rx_clock,       "Receiver oscillator actual/nominal" },
+  { "rx-cycles",  &Params::rx_cycles,      "Receiver cycles per decoder loop" },
+  { "rx-loop",    &Params::rx_loop_us,     "us per receiver main loop pass" },
+  { "tsop-on",    &Params::tsop_on,        "TSOP turn-on delay, carrier cycles" },
+  { "tsop-off",   &Params::tsop_off,       "TSOP turn-off delay, carrier cycles" },
+  { "tsop-min",   &Params::tsop_min_burst, "Shortest burst TSOP responds to" },
+  { "jitter",     &Params::jitter_us,      "us sigma of TSOP output edges" },
+  { "drop",       &Params::drop,           "Probability a burst is missed" },
+  { "glitch-rate",&Params::glitch_rate,    "Ambient light glitches per second" },
+  { "glitch-us",  &Params::glitch_us,      "Maximum glitch width in us" },
+  { "foreign",    &Params::foreign,        "Fraction of frames from another remote" },
+  { "rx-filter",  &Params::rx_filter,      "1: reject foreign device ID early" },
+  { "rx-skip",    &Params::rx_skip_ms,     "ms IR is ignored after rejecting" },
+  { "vcc",        &Params::vcc,            "Sender supply voltage" },
+  { "led-ma",     &Params::led_ma,         "IR LED current in mA while on" },
+  { "cpu-ma",     &Params::cpu_ma,         "Sender CPU active current in mA" },
+  { "idle-ma",    &Params::idle_ma,        "Sender CPU idle current in mA" },
+  { "tx-awake",   &Params::tx_awake,       "Sender cycles awake per tick; 0: no idle" },
+};
+static const int kNumParamNames = sizeof(kParamNames) / sizeof(kParamNames[0]);
+
+static double *FindParam(Params *p, const char *name) {
+  for (int i = 0; i < kNumParamNames; ++i) {
+    if (strcmp(kParamNames[i].name, name) == 0)
+      return &(p->*kParamNames[i].field);
+  }
+  return NULL;
+}
+
+struct Frame {
+  uint32_t code;
+  double start;     // Send() called.
+  double end;       // Sender is idle again after the last repeat.
+  bool decoded;
+  bool foreign;     // Not for us; must not be decoded.
+};
+
+struct Result {
+  int frames;       // Frames for us.
+  int foreign;      // Frames for another receiver.
+  int ok;
+  int garbage;      // Four bytes decoded that don't match the frame.
+  int wrong;        // ... and happen to be another valid command.
+  int bad_check;    // Four bytes decoded, but rejected by the check nibble.
+  double latency_sum;
+  double latency_max;
+  double to_decoder_sum;  // Latency: first burst until the decoder is entered
+  double in_decoder_sum;  // ... and from there until decoded.
+  double airtime_sum;
+  double led_on_sum;    // Time the IR LED is on.
+  double carrier_hz;
+  double decoder_busy;  // Total time spent in the decoder.
+};
+
+// Run the sender for "copies" of one frame starting at "start". Appends
+// the times the IR LED is switched on or off to "led_edges". Returns the time
+// the sender is idle again.
+static double TransmitFrame(uint32_t code, uint8_t copies,
+                            double start, const Params &p,
+                            std::vector<double> *led_edges, double *led_on) {
+  const size_t first_edge = led_edges->size();
+  Send(code, copies);
+  const double count = 1 / (SENDER_F_CPU * p.tx_clock);
+  const double tick = (OCR0A + 1) * count;
+  uint8_t last_out = PORTA & SENDER_IR_OUT_BIT;
+  double t = start;
+  for (long ticks = 1; /**/; ++ticks) {
+    t += tick;
+    TIM0_COMPA_vect();
+    uint8_t out = PORTA & SENDER_IR_OUT_BIT;
+    if (out != last_out) {
+      led_edges->push_back(t);
+      last_out = out;
+    }
+    if ((TIMSK0 & (1<<OCIE0B)) && TIM0_COMPB_vect) {
+      TIM0_COMPB_vect();  // Duty cycle < 50%
+      out = PORTA & SENDER_IR_OUT_BIT;
+      if (out != last_out) {
+        led_edges->push_back(t + (OCR0B + 1) * count);
+        last_out = out;
+      }
+    }
+    if (PollIsSendingDone())
+      break;
+  }
+  if (last_out) led_edges->push_back(t);  // Should not happen, but be safe.
+  for (size_t i = first_edge; i + 1 < led_edges->size(); i += 2)
+    *led_on += (*led_edges)[i+1] - (*led_edges)[i];
+  return t;
+}
+
+// Group the LED edges into carrier bursts and let the TSOP make an output
+// envelope of it.
+static void TsopEnvelope(const std::vector<double> &led_edges, const Params &p,
+                         std::mt19937 *rnd, std::vector<LowPhase> *out,
+                         double *carrier_hz) {
+  std::uniform_real_distribution<double> uniform(0, 1);
+  std::normal_distribution<double> jitter(0, p.jitter_us * 1e-6);
+  double carrier_sum = 0;
+  int carrier_bursts = 0;
+  for (size_t i = 0; i + 1 < led_edges.size(); /**/) {
+    // Edges come in on/off pairs. Collect pulses that follow closely.
+    const size_t first = i;
+    double period = 0;
+    i += 2;
+    while (i + 1 < led_edges.size()) {
+      const double this_period = led_edges[i] - led_edges[i-2];
+      if (period > 0 && this_period > 2.5 * period) break;
+      if (period == 0) period = this_period;
+      i += 2;
+    }
+    const int cycles = (i - first) / 2;
+    const double burst_start = led_edges[first];
+    const double burst_end = led_edges[i-1];
+    if (cycles < 2) continue;
+    const double fc = (cycles - 1) / (led_edges[i-2] - burst_start);
+    carrier_sum += fc;
+    ++carrier_bursts;
+    if (cycles < p.tsop_min_burst) continue;
+    if (uniform(*rnd) < p.drop) continue;
+    LowPhase phase;
+    phase.start = burst_start + p.tsop_on / fc + jitter(*rnd);
+    phase.end = burst_end + p.tsop_off / fc + jitter(*rnd);
+    out->push_back(phase);
+  }
+  if (carrier_bursts) *carrier_hz = carrier_sum / carrier_bursts;
+}
+
+static void AddGlitches(double until, const Params &p, std::mt19937 *rnd,
+                        std::vector<LowPhase> *out) {
+  if (p.glitch_rate <= 0) return;
+  std::exponential_distribution<double> next(p.glitch_rate);
+  std::uniform_real_distribution<double> width(1e-6, p.glitch_us * 1e-6);
+  for (double t = next(*rnd); t < until; t += next(*rnd)) {
+    LowPhase phase;
+    phase.start = t;
+    phase.end = t + width(*rnd);
+    out->push_back(phase);
+  }
+}
+
+static bool IsValidCommand(uint32_t code) {
+  for (int i = 0; i < kNumCommands; ++i)
+    if (kCommands[i] == (code & 0xffffff00)) return true;
+  return false;
+}
+
+// Send frames and run them through the channel. Returns the time of the
+// end of the transmission.
+static double MakeTimeline(const Params &p, std::mt19937 *rnd, Result *r,
+                           std::vector<Frame> *frames,
+                           std::vector<LowPhase> *phases) {
+  std::uniform_int_distribution<int> pick(0, kNumCommands - 1);
+  std::uniform_real_distribution<double> uniform(0, 1);
+  std::vector<double> led_edges;
+  double t = p.start_ms * 1e-3;
+  for (int i = 0; i < (int)p.frames; ++i) {
+    Frame f;
+    f.code = kCommands[pick(*rnd)];
+    f.foreign = uniform(*rnd) < p.foreign;
+    if (f.foreign) {
+      f.code = (f.code & 0x00ffffff) | (uint32_t)FOREIGN_DEVICE_ID << 24;
+      ++r->foreign;
+    }
+    f.code = AddSequence(f.code, i);
+    f.start = t;
+    double led_on = 0;
+    f.end = t;
+    f.end = TransmitFrame(f.code, p.repeats < 1 ? 1 : (int)p.repeats,
+                          f.end, p, &led_edges, &led_on);
+    f.decoded = false;
+    if (!f.foreign) {
+      r->airtime_sum += f.end - f.start;
+      r->led_on_sum += led_on;
+    }
+    frames->push_back(f);
+    t = f.end + p.gap_ms * 1e-3;
+  }
+  const double end_of_time = t + 0.05;
+
+  TsopEnvelope(led_edges, p, rnd, phases, &r->carrier_hz);
+  AddGlitches(end_of_time, p, rnd, phases);
+  MergeLowPhases(phases);
+  return end_of_time;
+}
+
+static Result RunLink(const Params &p, unsigned int seed) {
+  std::mt19937 rnd(seed);
+  Result r;
+  memset(&r, 0, sizeof(r));
+
+  std::vector<Frame> frames;
+  std::vector<LowPhase> phases;
+  const double end_of_time = MakeTimeline(p, &rnd, &r, &frames, &phases);
+
+  // Receiver main loop.
+  SimPin::Reset(&phases, p.rx_cycles / (RECEIVER_F_CPU * p.rx_clock));
+  const double loop_time = p.rx_loop_us * 1e-6 / p.rx_clock;
+  size_t current_frame = 0;
+  uint8_t buffer[4];
+  while (SimPin::now < end_of_time) {
+    if (sim_infrared_in()) {
+      // Nothing to see. Fast forward to the next pass seeing a low level.
+      const double next_low = SimPin::NextLow();
+      if (next_low < 0) break;
+      const double passes = ceil((next_low - SimPin::now) / loop_time);
+      SimPin::now += (passes > 1 ? passes : 1) * loop_time;
+      continue;
+    }
+    const double decode_start = SimPin::now;
+    const uint8_t got = p.rx_filter
+      ? decode_infrared<sim_infrared_in, AcceptOurDevice>(buffer, 0)
+      : decode_infrared<sim_infrared_in>(buffer, 0);
+    r.decoder_busy += SimPin::now - decode_start;
+    if (got == IR_FOREIGN_FRAME) {
+      SimPin::now += p.rx_skip_ms * 1e-3;
+      continue;
+    }
+    if (got == 4 && buffer[0] != DEVICE_ID) {
+      // What the receiver does without the early filter.
+      SimPin::now += loop_time;
+      continue;
+    }
+    if (got == 4 && !FrameCheckOk(buffer)) {
+      ++r.bad_check;  // Dropped by the receiver.
+      SimPin::now += loop_time;
+      continue;
+    }
+    if (got == 4) {
+      const uint32_t code = ((uint32_t)buffer[0] << 24 |
+                             (uint32_t)buffer[1] << 16 |
+                             (uint32_t)buffer[2] << 8 | buffer[3]);
+      while (current_frame + 1 < frames.size()
+             && frames[current_frame + 1].start <= SimPin::now) {
+        ++current_frame;
+      }
+      Frame &f = frames[current_frame];
+      if (code == f.code && f.decoded) {
+        // A repeat; the receiver drops it by its sequence number.
+      } else if (code == f.code) {
+        f.decoded = true;
+        ++r.ok;
+        const double latency = SimPin::now - f.start;
+        r.latency_sum += latency;
+        if (latency > r.latency_max) r.latency_max = latency;
+        r.to_decoder_sum += decode_start - f.start;
+        r.in_decoder_sum += SimPin::now - decode_start;
+      } else {
+        ++r.garbage;
+        if (IsValidCommand(code)) ++r.wrong;
+      }
+    }
+    SimPin::now += loop_time;
+  }
+  r.frames = frames.size() - r.foreign;
+  return r;
+}
+
+// Print the TSOP output in the stimulus format of avr-bench.
+static void PrintStimulus(const Params &p, unsigned int seed, const char *pin) {
+  std::mt19937 rnd(seed);
+  Result r;
+  memset(&r, 0, sizeof(r));
+  std::vector<Frame> frames;
+  std::vector<LowPhase> phases;
+  MakeTimeline(p, &rnd, &r, &frames, &phases);
+  printf("# %d IR frames, generated by ir-link-sim\n", (int)frames.size());
+  printf("%.3f %s 1\n", 0.0, pin);
+  for (size_t i = 0; i < phases.size(); ++i) {
+    printf("%.3f %s 0\n", 1e3 * phases[i].start, pin);
+    printf("%.3f %s 1\n", 1e3 * phases[i].end, pin);
+  }
+}
+
+static void PrintHeader(const char *sweep_name) {
+  printf("# %-10s %6s %6s %6s %7s %5s %8s %8s %8s %9s\n",
+         sweep_name ? sweep_name : "", "frames", "ok", "missed", "garbage",
+         "wrong", "FER", "lat-avg", "lat-max", "airtime");
+  printf("# %-10s %6s %6s %6s %7s %5s %8s %8s %8s %9s\n",
+         "", "", "", "", "", "", "", "ms", "ms", "ms");
+}
+
+static void PrintResult(double value, const Result &r) {
+  printf("%12.4g %6d %6d %6d %7d %5d %8.5f %8.2f %8.2f %9.2f\n",
+         value, r.frames, r.ok, r.frames - r.ok, r.garbage, r.wrong,
+         1.0 - (double)r.ok / r.frames,
+         r.ok ? 1e3 * r.latency_sum / r.ok : 0.0, 1e3 * r.latency_max,
+         1e3 * r.airtime_sum / r.frames);
+}
+
+static int usage(const char *progname, const Params &p) {
+  fprintf(stderr, "usage: %s [options]\n"
+          "Options:\n"
+          "\t-p <name>=<value>           : Set channel parameter.\n"
+          "\t-S <name>=<from>:<to>:<step>: Sweep parameter.\n"
+          "\t-s <seed>                   : Random seed.\n"
+          "\t-o <port><bit>              : Don't decode; print TSOP output\n"
+          "\t                              as stimulus for avr-bench.\n"
+          "Parameters (and defaults):\n", progname);
+  for (int i = 0; i < kNumParamNames; ++i) {
+    fprintf(stderr, "\t%-12s %-8g %s\n", kParamNames[i].name,
+            p.*kParamNames[i].field, kParamNames[i].description);
+  }
+  fprintf(stderr, "Bit timings are compile-time; rebuild with e.g.\n"
+          "\tmake clean all SIM_DEFINES='-DIR_BIT_1_PAUSE=80 "
+          "-DIR_LO_HI_BIT_THRESHOLD=0x260'\n");
+  return 1;
+}
+
+int main(int argc, char *argv[]) {
+  Params params;
+  params.start_ms = 1;
+  params.frames = 1000;
+  params.gap_ms = 50;
+  params.tx_clock = 1.0;  // The sender calibrates its oscillator.
+  params.repeats = kFrameRepeats;  // As the firmware sends.
+  params.rx_clock = 1.0;
+  params.rx_cycles = 9;
+  params.rx_loop_us = 50;
+  params.tsop_on = 7;
+  params.tsop_off = 5;
+  params.tsop_min_burst = 6;
+  params.jitter_us = 10;
+  params.drop = 0;
+  params.glitch_rate = 0;
+  params.glitch_us = 100;
+  params.foreign = 0;
+  params.rx_filter = 1;
+  params.rx_skip_ms = 20;
+  params.vcc = 3.0;
+  params.led_ma = 100;
+  params.cpu_ma = 1.5;
+  params.idle_ma = 0.35;
+  params.tx_awake = 40;
+
+  unsigned int seed = 42;
+  const char *sweep_name = NULL;
+  double sweep_from = 0, sweep_to = 0, sweep_step = 1;
+  const char *stimulus_pin = NULL;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "p:S:s:o:h")) != -1) {
+    char name[32];
+    double value;
+    switch (opt) {
+    case 'p':
+      if (sscanf(optarg, "%31[^=]=%lf", name, &value) != 2
+          || FindParam(&params, name) == NULL) {
+        fprintf(stderr, "Invalid parameter '%s'\n", optarg);
+        return usage(argv[0], params);
+      }
+      *FindParam(&params, name) = value;
+      break;
+    case 'S':
+      if (sscanf(optarg, "%31[^=]=%lf:%lf:%lf", name,
+                 &sweep_from, &sweep_to, &sweep_step) != 4
+          || FindParam(&params, name) == NULL || sweep_step <= 0) {
+        fprintf(stderr, "Invalid sweep '%s'\n", optarg);
+        return usage(argv[0], params);
+      }
+      sweep_name = strdup(name);
+      break;
+    case 's':
+      seed = atoi(optarg);
+      break;
+    case 'o':
+      stimulus_pin = strdup(optarg);
+      break;
+    default:
+      return usage(argv[0], params);
+    }
+  }
+
+  if (stimulus_pin) {
+    PrintStimulus(params, seed, stimulus_pin);
+    return 0;
+  }
+
+  printf("# bit threshold: %d loops (%.1fus at nominal rx clock)\n",
+         IR_LO_HI_BIT_THRESHOLD,
+         1e6 * IR_LO_HI_BIT_THRESHOLD * params.rx_cycles / RECEIVER_F_CPU);
+  PrintHeader(sweep_name);
+  if (sweep_name == NULL) {
+    const Result r = RunLink(params, seed);
+    PrintResult(0, r);
+    printf("# carrier: %.0fHz\n", r.carrier_hz);
+    if (r.ok) {
+      // Sender wake-up and the pot write are not simulated; see
+      // LATENCY_MARKERS in the firmware to measure them.
+      printf("# latency: %.2fms to decoder + %.2fms in decoder\n",
+             1e3 * r.to_decoder_sum / r.ok, 1e3 * r.in_decoder_sum / r.ok);
+    }
+    printf("# foreign frames: %d; failed check: %d; decoder busy: %.1fms\n",
+           r.foreign, r.bad_check, 1e3 * r.decoder_busy);
+    // Sender energy per frame. Without idling, the CPU is active all the
+    // time; with it, only tx-awake cycles of each ISR tick.
+    const double frame_s = r.airtime_sum / r.frames;
+    const double tick_cycles = OCR0A + 1;
+    const double awake = params.tx_awake > 0
+      ? std::min(1.0, params.tx_awake / tick_cycles) : 1.0;
+    const double led_uj = 1e3 * params.vcc * params.led_ma
+      * r.led_on_sum / r.frames;
+    const double cpu_uj = 1e3 * params.vcc * frame_s
+      * (awake * params.cpu_ma + (1 - awake) * params.idle_ma);
+    printf("# sender energy per frame: LED %.1fuJ (on %.2fms) + CPU %.1fuJ "
+           "= %.1fuJ\n", led_uj, 1e3 * r.led_on_sum / r.frames, cpu_uj,
+           led_uj + cpu_uj);
+    return 0;
+  }
+
+  double *sweep_param = FindParam(&params, sweep_name);
+  for (double v = sweep_from; v <= sweep_to + sweep_step / 1000;
+       v += sweep_step) {
+    *sweep_param = v;
+    PrintResult(v, RunLink(params, seed));
+  }
+  return 0;
+}
@@ -0,0 +1,46 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * Copyright (c) h.zeller@acm.org. GNU public License.
+ */
+#include "sim-pin.h"
+
+#include <algorithm>
+
+namespace SimPin {
+const std::vector<LowPhase> *low_phases = 0;
+size_t cursor = 0;
+double now = 0;
+double read_cost = 0;
+unsigned long reads = 0;
+
+void Reset(const std::vector<LowPhase> *phases, double read_cost_seconds) {
+  low_phases = phases;
+  cursor = 0;
+  now = 0;
+  read_cost = read_cost_seconds;
+  reads = 0;
+}
+
+double NextLow() {
+  if (Level() == false) return now;
+  return cursor < low_phases->size() ? (*low_phases)[cursor].start : -1;
+}
+}
+
+static bool ByStart(const LowPhase &a, const LowPhase &b) {
+  return a.start < b.start;
+}
+
+void MergeLowPhases(std::vector<LowPhase> *phases) {
+  std::sort(phases->begin(), phases->end(), ByStart);
+  size_t out = 0;
+  for (size_t i = 0; i < phases->size(); ++i) {
+    const LowPhase &p = (*phases)[i];
+    if (p.end <= p.start) continue;
+    if (out > 0 && p.start <= (*phases)[out-1].end) {
+      (*phases)[out-1].end = std::max((*phases)[out-1].end, p.end);
+    } else {
+      (*phases)[out++] = p;
+    }
+  }
+  phases->resize(out);
+}
@@ -0,0 +1,55 @@
+/* -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+ * Copyright (c) h.zeller@acm.org. GNU public License.
+ *
+ * Simulated TSOP output pin for running the receiver decoder on the host.
+ */
+#ifndef SIM_PIN_H_
+#define SIM_PIN_H_
+
+#include <stddef.h>
+#include <vector>
+
+// A phase in which the (active low) receiver output is low. Seconds.
+struct LowPhase {
+  double start;
+  double end;
+};
+
+// The pin as seen by the receiver: a sorted, non-overlapping list of low
+// phases, high everywhere else. Each read advances the receiver time by
+// the cost of one decoder loop iteration, so the decoder, which measures
+// time by counting loop iterations, sees the same durations as on the AVR.
+namespace SimPin {
+extern const std::vector<LowPhase> *low_phases;
+extern size_t cursor;          // First phase that might not be over yet.
+extern double now;             // Current receiver time in seconds.
+extern double read_cost;       // Seconds per read.
+extern unsigned long reads;    // Number of reads, for statistics.
+
+// Set the timeline to play back and rewind.
+void Reset(const std::vector<LowPhase> *phases, double read_cost_seconds);
+
+// Level of the pin at the current time without advancing it.
+static inline bool Level() {
+  const std::vector<LowPhase> &p = *low_phases;
+  while (cursor < p.size() && p[cursor].end <= now)
+    ++cursor;
+  return !(cursor < p.size() && p[cursor].start <= now);
+}
+
+// Start of the next low phase at or after "now"; negative if there is none.
+double NextLow();
+}
+
+// To be used as template parameter for decode_infrared().
+static inline bool sim_infrared_in() {
+  const bool level = SimPin::Level();
+  SimPin::now += SimPin::read_cost;
+  ++SimPin::reads;
+  return level;
+}
+
+// Sort "phases" and merge overlapping ones.
+void MergeLowPhases(std::vector<LowPhase> *phases);
+
+#endif  // SIM_PIN_H_